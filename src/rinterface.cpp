@@ -1,42 +1,431 @@
+#include <string>
+#include <vector>
+#include <cstring>
+#include <boost/optional.hpp>
+#include <iostream>
+#include "vina/main/main.h"
+#include "vina/main/vina_error.h"
 #include <R.h>
 #include <Rmath.h>
 #include <Rdefines.h>
 #include <Rinternals.h>
-#include "vina/main/main.h"
-#include "vina/main/vina_error.h"
-#include <string>
-#include <boost/optional.hpp>
-#include <iostream>
+
+// error() longjmps, skipping C++ destructors, so .Call entry points copy the
+// message here and only call error() once their C++ objects are out of scope
+static char vina_error_message[8192];
+
+static void keep_error_message(const vina_error& e) {
+  std::strncpy(vina_error_message, e.error_message.c_str(), sizeof(vina_error_message) - 1);
+  vina_error_message[sizeof(vina_error_message) - 1] = '\0';
+}
+
+static boost::optional<std::string> optional_string(SEXP x) {
+  boost::optional<std::string> tmp;
+  if (!isNull(x) && length(x) > 0)
+    tmp = std::string(CHAR(STRING_ELT(x, 0)));
+  return tmp;
+}
+
+static std::vector<std::string> string_vector(SEXP x) {
+  std::vector<std::string> tmp;
+  for (int i = 0; i < length(x); ++i)
+    tmp.push_back(std::string(CHAR(STRING_ELT(x, i))));
+  return tmp;
+}
+
+// a file name, or a label for the PDBQT text if that is given (NULL otherwise)
+static pdbqt_input input_at(SEXP names, SEXP texts, int i) {
+  std::string name(CHAR(STRING_ELT(names, i)));
+  if (!isNull(texts) && length(texts) > i)
+    return pdbqt_input(name, std::string(CHAR(STRING_ELT(texts, i))));
+  return pdbqt_input(name);
+}
+
+static boost::optional<pdbqt_input> optional_input(SEXP name, SEXP text) {
+  boost::optional<pdbqt_input> tmp;
+  if (!isNull(name) && length(name) > 0)
+    tmp = input_at(name, text, 0);
+  return tmp;
+}
+
+static std::vector<pdbqt_input> input_vector(SEXP names, SEXP texts) {
+  std::vector<pdbqt_input> tmp;
+  for (int i = 0; i < length(names); ++i)
+    tmp.push_back(input_at(names, texts, i));
+  return tmp;
+}
+
+// NULL arguments keep the defaults; center and size are the search space
+static search_settings settings_from(SEXP center, SEXP size, SEXP cpu, SEXP exhaustiveness, SEXP seed) {
+  search_settings tmp;
+  if (!isNull(center)) {
+    tmp.center_x = REAL(center)[0];
+    tmp.center_y = REAL(center)[1];
+    tmp.center_z = REAL(center)[2];
+  }
+  if (!isNull(size)) {
+    tmp.size_x = REAL(size)[0];
+    tmp.size_y = REAL(size)[1];
+    tmp.size_z = REAL(size)[2];
+  }
+  if (!isNull(cpu))
+    tmp.cpu = INTEGER(cpu)[0];
+  if (!isNull(exhaustiveness))
+    tmp.exhaustiveness = INTEGER(exhaustiveness)[0];
+  if (!isNull(seed))
+    tmp.seed = INTEGER(seed)[0];
+  return tmp;
+}
+
+// pockets is a matrix with one row per pocket: the x, y and z of its center, then of its size; NULL arguments keep the defaults
+static void space_settings(search_settings& settings, SEXP pockets, SEXP split_box) {
+  if (!isNull(split_box))
+    settings.split_box = LOGICAL(split_box)[0] == TRUE;
+  if (isNull(pockets))
+    return;
+  const int n = nrows(pockets);
+  for (int i = 0; i < n; ++i) {
+    vina_pocket p;
+    p.center_x = REAL(pockets)[i];
+    p.center_y = REAL(pockets)[i + n];
+    p.center_z = REAL(pockets)[i + 2 * n];
+    p.size_x = REAL(pockets)[i + 3 * n];
+    p.size_y = REAL(pockets)[i + 4 * n];
+    p.size_z = REAL(pockets)[i + 5 * n];
+    settings.pockets.push_back(p);
+  }
+}
+
+// how the grid maps and scoring tables are kept; NULL arguments keep the defaults
+static void grid_settings(search_settings& settings, SEXP cache_dir, SEXP grid_storage, SEXP grid_layout, SEXP grid_interleave,
+                          SEXP grid_spacing, SEXP grid_interpolation, SEXP grid_lazy, SEXP compact_tables) {
+  settings.cache_dir = optional_string(cache_dir).get_value_or("");
+  if (!isNull(grid_storage))
+    settings.grid_storage = CHAR(STRING_ELT(grid_storage, 0));
+  if (!isNull(grid_layout))
+    settings.grid_layout = CHAR(STRING_ELT(grid_layout, 0));
+  if (!isNull(grid_interleave))
+    settings.grid_interleave = LOGICAL(grid_interleave)[0] == TRUE;
+  if (!isNull(grid_spacing))
+    settings.grid_spacing = REAL(grid_spacing)[0];
+  if (!isNull(grid_interpolation))
+    settings.grid_interpolation = CHAR(STRING_ELT(grid_interpolation, 0));
+  if (!isNull(grid_lazy))
+    settings.grid_lazy = LOGICAL(grid_lazy)[0] == TRUE;
+  if (!isNull(compact_tables))
+    settings.compact_tables = LOGICAL(compact_tables)[0] == TRUE;
+}
+
+// list(phases, evals, bfgs_steps, line_search_trials): wall, cpu and calls per phase, then the search counters
+static SEXP profile_to_list(const vina_profile& profile) {
+  const int n = profile.phases.size();
+  SEXP phases = PROTECT(allocMatrix(REALSXP, n, 3));
+  SEXP phase_names = PROTECT(allocVector(STRSXP, n));
+  for (int i = 0; i < n; ++i) {
+    const vina_phase& ph = profile.phases[i];
+    REAL(phases)[i] = ph.wall;
+    REAL(phases)[i + n] = ph.cpu;
+    REAL(phases)[i + 2 * n] = ph.calls;
+    SET_STRING_ELT(phase_names, i, mkChar(ph.name.c_str()));
+  }
+  SEXP columns = PROTECT(allocVector(STRSXP, 3));
+  SET_STRING_ELT(columns, 0, mkChar("wall"));
+  SET_STRING_ELT(columns, 1, mkChar("cpu"));
+  SET_STRING_ELT(columns, 2, mkChar("calls"));
+  SEXP dimnames = PROTECT(allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(dimnames, 0, phase_names);
+  SET_VECTOR_ELT(dimnames, 1, columns);
+  setAttrib(phases, R_DimNamesSymbol, dimnames);
+
+  SEXP ans = PROTECT(allocVector(VECSXP, 4));
+  SET_VECTOR_ELT(ans, 0, phases);
+  SET_VECTOR_ELT(ans, 1, ScalarReal(profile.evals));
+  SET_VECTOR_ELT(ans, 2, ScalarReal(profile.bfgs_steps));
+  SET_VECTOR_ELT(ans, 3, ScalarReal(profile.line_search_trials));
+  SEXP names = PROTECT(allocVector(STRSXP, 4));
+  SET_STRING_ELT(names, 0, mkChar("phases"));
+  SET_STRING_ELT(names, 1, mkChar("evals"));
+  SET_STRING_ELT(names, 2, mkChar("bfgs_steps"));
+  SET_STRING_ELT(names, 3, mkChar("line_search_trials"));
+  setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(6);
+  return ans;
+}
+
+// list(energy, rmsd_lb, rmsd_ub, coords, pocket, profile), with one element (or matrix of
+// movable heavy atom coordinates, one row per atom) per mode, except for the profile
+static SEXP result_to_list(const vina_result& result) {
+  const int n = result.modes.size();
+  SEXP energy = PROTECT(allocVector(REALSXP, n));
+  SEXP rmsd_lb = PROTECT(allocVector(REALSXP, n));
+  SEXP rmsd_ub = PROTECT(allocVector(REALSXP, n));
+  SEXP coords = PROTECT(allocVector(VECSXP, n));
+  SEXP pocket = PROTECT(allocVector(INTSXP, n));
+  for (int i = 0; i < n; ++i) {
+    const vina_mode& mode = result.modes[i];
+    INTEGER(pocket)[i] = mode.pocket + 1;
+    REAL(energy)[i] = mode.energy;
+    REAL(rmsd_lb)[i] = mode.rmsd_lb;
+    REAL(rmsd_ub)[i] = mode.rmsd_ub;
+    const int num_atoms = mode.coords.size() / 3;
+    SEXP xyz = allocMatrix(REALSXP, num_atoms, 3);
+    SET_VECTOR_ELT(coords, i, xyz);
+    for (int a = 0; a < num_atoms; ++a)
+      for (int j = 0; j < 3; ++j)
+        REAL(xyz)[a + num_atoms * j] = mode.coords[3 * a + j];
+  }
+
+  SEXP profile = PROTECT(profile_to_list(result.profile));
+  SEXP ans = PROTECT(allocVector(VECSXP, 6));
+  SET_VECTOR_ELT(ans, 0, energy);
+  SET_VECTOR_ELT(ans, 1, rmsd_lb);
+  SET_VECTOR_ELT(ans, 2, rmsd_ub);
+  SET_VECTOR_ELT(ans, 3, coords);
+  SET_VECTOR_ELT(ans, 4, pocket);
+  SET_VECTOR_ELT(ans, 5, profile);
+  SEXP names = PROTECT(allocVector(STRSXP, 6));
+  SET_STRING_ELT(names, 0, mkChar("energy"));
+  SET_STRING_ELT(names, 1, mkChar("rmsd_lb"));
+  SET_STRING_ELT(names, 2, mkChar("rmsd_ub"));
+  SET_STRING_ELT(names, 3, mkChar("coords"));
+  SET_STRING_ELT(names, 4, mkChar("pocket"));
+  SET_STRING_ELT(names, 5, mkChar("profile"));
+  setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(8);
+  return ans;
+}
+
+static receptor_session* receptor_pointer(SEXP receptor) {
+  if (TYPEOF(receptor) != EXTPTRSXP)
+    error("not a vina_receptor handle");
+  receptor_session* rs = static_cast<receptor_session*>(R_ExternalPtrAddr(receptor));
+  if (!rs)
+    error("the vina_receptor handle is no longer valid");
+  return rs;
+}
+
+static void receptor_finalizer(SEXP receptor) {
+  receptor_session* rs = static_cast<receptor_session*>(R_ExternalPtrAddr(receptor));
+  if (rs) {
+    vina_receptor_free(rs);
+    R_ClearExternalPtr(receptor);
+  }
+}
 
 #ifdef __cplusplus
 extern "C" {
 #endif
-  void vina(char** rigid_name, char** flex_name, char** ligand_name, char** out_name) {
-    boost::optional<std::string> rigid_name_opt, flex_name_opt, out_name_opt;
+  SEXP vina(SEXP rigid_name, SEXP flex_name, SEXP ligand_name, SEXP out_name,
+            SEXP center, SEXP size, SEXP pockets, SEXP split_box, SEXP cpu, SEXP exhaustiveness, SEXP seed, SEXP cache_dir, SEXP grid_storage,
+            SEXP grid_layout, SEXP grid_interleave, SEXP grid_spacing, SEXP grid_interpolation, SEXP grid_lazy, SEXP compact_tables) {
+    SEXP ans = R_NilValue;
+    bool failed = false;
+    {
+      boost::optional<std::string> rigid_name_opt = optional_string(rigid_name);
+      boost::optional<std::string> flex_name_opt = optional_string(flex_name);
+      boost::optional<std::string> out_name_opt = optional_string(out_name);
+      std::string ligand_name_str(CHAR(STRING_ELT(ligand_name, 0)));
+      search_settings settings = settings_from(center, size, cpu, exhaustiveness, seed);
+      grid_settings(settings, cache_dir, grid_storage, grid_layout, grid_interleave, grid_spacing, grid_interpolation, grid_lazy, compact_tables);
+      space_settings(settings, pockets, split_box);
+      vina_result result;
+
+      Rprintf("ligand %s \n", ligand_name_str.c_str());
+      if (rigid_name_opt)
+        Rprintf("rigid %s \n", rigid_name_opt.get().c_str());
+      if (flex_name_opt)
+        Rprintf("flex %s \n", flex_name_opt.get().c_str());
+      if (out_name_opt)
+        Rprintf("out %s \n", out_name_opt.get().c_str());
+
+      try{
+        vina_cpp(rigid_name_opt, flex_name_opt, ligand_name_str, out_name_opt, settings, result);
+      }
+      catch(vina_error& e) {
+        keep_error_message(e);
+        failed = true;
+      }
+      if (!failed)
+        ans = PROTECT(result_to_list(result));
+    }
+    if (failed)
+      error("%s", vina_error_message);
+    UNPROTECT(1);
+    return ans;
+  }
+
+  SEXP vina_screen(SEXP rigid_name, SEXP rigid_text, SEXP flex_name, SEXP flex_text,
+                   SEXP ligand_names, SEXP ligand_texts, SEXP out_names,
+                   SEXP center, SEXP size, SEXP pockets, SEXP split_box, SEXP cpu, SEXP exhaustiveness, SEXP seed, SEXP cache_dir, SEXP grid_storage,
+                   SEXP grid_layout, SEXP grid_interleave, SEXP grid_spacing, SEXP grid_interpolation, SEXP grid_lazy, SEXP compact_tables) {
+    SEXP ans = R_NilValue;
+    bool failed = false;
+    {
+      boost::optional<pdbqt_input> rigid_opt = optional_input(rigid_name, rigid_text);
+      boost::optional<pdbqt_input> flex_opt = optional_input(flex_name, flex_text);
+      std::vector<pdbqt_input> ligands = input_vector(ligand_names, ligand_texts);
+      std::vector<std::string> outs = string_vector(out_names);
+      search_settings settings = settings_from(center, size, cpu, exhaustiveness, seed);
+      grid_settings(settings, cache_dir, grid_storage, grid_layout, grid_interleave, grid_spacing, grid_interpolation, grid_lazy, compact_tables);
+      space_settings(settings, pockets, split_box);
+      std::vector<vina_result> results;
+
+      try{
+        vina_screen_cpp(rigid_opt, flex_opt, ligands, outs, settings, results);
+      }
+      catch(vina_error& e) {
+        keep_error_message(e);
+        failed = true;
+      }
+      if (!failed) {
+        ans = PROTECT(allocVector(VECSXP, results.size()));
+        for (size_t i = 0; i < results.size(); ++i)
+          SET_VECTOR_ELT(ans, i, result_to_list(results[i]));
+      }
+    }
+    if (failed)
+      error("%s", vina_error_message);
+    UNPROTECT(1);
+    return ans;
+  }
 
-    Rprintf("ligand %s \n", ligand_name[0]);
+  SEXP vina_receptor(SEXP rigid_name, SEXP rigid_text, SEXP flex_name, SEXP flex_text, SEXP center, SEXP size, SEXP pockets, SEXP split_box,
+                     SEXP cache_dir, SEXP grid_storage, SEXP grid_layout, SEXP grid_interleave, SEXP grid_spacing, SEXP grid_interpolation, SEXP grid_lazy, SEXP compact_tables) {
+    receptor_session* rs = NULL;
+    bool failed = false;
+    {
+      pdbqt_input rigid = input_at(rigid_name, rigid_text, 0);
+      boost::optional<pdbqt_input> flex_opt = optional_input(flex_name, flex_text);
+      search_settings settings = settings_from(center, size, R_NilValue, R_NilValue, R_NilValue);
+      grid_settings(settings, cache_dir, grid_storage, grid_layout, grid_interleave, grid_spacing, grid_interpolation, grid_lazy, compact_tables);
+      space_settings(settings, pockets, split_box);
+      try{
+        rs = vina_receptor_cpp(rigid, flex_opt, settings);
+      }
+      catch(vina_error& e) {
+        keep_error_message(e);
+        failed = true;
+      }
+    }
+    if (failed)
+      error("%s", vina_error_message);
 
-    if (rigid_name) {
-      Rprintf("rigid %s \n", rigid_name[0]);
-      rigid_name_opt = std::string(rigid_name[0]);
+    SEXP ptr = PROTECT(R_MakeExternalPtr(rs, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(ptr, receptor_finalizer, TRUE);
+    UNPROTECT(1);
+    return ptr;
+  }
+
+  SEXP vina_dock(SEXP receptor, SEXP ligand_name, SEXP ligand_text, SEXP out_name,
+                 SEXP cpu, SEXP exhaustiveness, SEXP seed) {
+    receptor_session* rs = receptor_pointer(receptor);
+    SEXP ans = R_NilValue;
+    bool failed = false;
+    {
+      pdbqt_input ligand = input_at(ligand_name, ligand_text, 0);
+      boost::optional<std::string> out_name_opt = optional_string(out_name);
+      vina_result result;
+      try{
+        vina_dock_cpp(*rs, ligand, out_name_opt, settings_from(R_NilValue, R_NilValue, cpu, exhaustiveness, seed), result);
+      }
+      catch(vina_error& e) {
+        keep_error_message(e);
+        failed = true;
+      }
+      if (!failed)
+        ans = PROTECT(result_to_list(result));
     }
-    if (flex_name) {
-      Rprintf("flex %s \n", flex_name[0]);
-      flex_name_opt = std::string(flex_name[0]);
-    }if (out_name) {
-      Rprintf("out %s \n", out_name[0]);
-      out_name_opt = std::string(out_name[0]);
+    if (failed)
+      error("%s", vina_error_message);
+    UNPROTECT(1);
+    return ans;
+  }
+
+  SEXP vina_submit(SEXP receptor, SEXP ligand_name, SEXP ligand_text, SEXP out_name,
+                   SEXP cpu, SEXP exhaustiveness, SEXP seed) {
+    receptor_session* rs = receptor_pointer(receptor);
+    int job = 0;
+    bool failed = false;
+    {
+      pdbqt_input ligand = input_at(ligand_name, ligand_text, 0);
+      boost::optional<std::string> out_name_opt = optional_string(out_name);
+      try{
+        job = vina_submit_cpp(*rs, ligand, out_name_opt, settings_from(R_NilValue, R_NilValue, cpu, exhaustiveness, seed));
+      }
+      catch(vina_error& e) {
+        keep_error_message(e);
+        failed = true;
+      }
     }
+    if (failed)
+      error("%s", vina_error_message);
+    return ScalarInteger(job);
+  }
 
+  SEXP vina_poll(SEXP job) {
+    vina_job_status status = vina_job_failed;
+    bool failed = false;
+    try{
+      status = vina_poll_cpp(INTEGER(job)[0]);
+    }
+    catch(vina_error& e) {
+      keep_error_message(e);
+      failed = true;
+    }
+    if (failed)
+      error("%s", vina_error_message);
+
+    switch (status) {
+    case vina_job_queued: return mkString("queued");
+    case vina_job_running: return mkString("running");
+    case vina_job_done: return mkString("done");
+    default: return mkString("failed");
+    }
+  }
 
+  SEXP vina_progress(SEXP job) {
+    unsigned long steps_done = 0, steps_total = 0;
+    bool failed = false;
     try{
-  		vina_cpp(rigid_name_opt, flex_name_opt, std::string(ligand_name[0]), out_name_opt);
-  	}
-  	catch(vina_error& e) {
-  		error(e.error_message.c_str());
-  	}
+      vina_progress_cpp(INTEGER(job)[0], steps_done, steps_total);
+    }
+    catch(vina_error& e) {
+      keep_error_message(e);
+      failed = true;
+    }
+    if (failed)
+      error("%s", vina_error_message);
 
+    SEXP ans = PROTECT(allocVector(REALSXP, 2));
+    REAL(ans)[0] = steps_done;
+    REAL(ans)[1] = steps_total;
+    SEXP names = PROTECT(allocVector(STRSXP, 2));
+    SET_STRING_ELT(names, 0, mkChar("done"));
+    SET_STRING_ELT(names, 1, mkChar("total"));
+    setAttrib(ans, R_NamesSymbol, names);
+    UNPROTECT(2);
+    return ans;
+  }
 
+  SEXP vina_collect(SEXP job) {
+    SEXP ans = R_NilValue;
+    bool failed = false;
+    {
+      vina_result result;
+      try{
+        vina_collect_cpp(INTEGER(job)[0], result);
+      }
+      catch(vina_error& e) {
+        keep_error_message(e);
+        failed = true;
+      }
+      if (!failed)
+        ans = PROTECT(result_to_list(result));
+    }
+    if (failed)
+      error("%s", vina_error_message);
+    UNPROTECT(1);
+    return ans;
   }
 #ifdef __cplusplus
 }
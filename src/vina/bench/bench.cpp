@@ -0,0 +1,744 @@
+/*
+
+   Copyright (c) 2006-2010, The Scripps Research Institute
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   Author: Dr. Oleg Trott <ot14@columbia.edu>,
+           The Olson Lab,
+           The Scripps Research Institute
+
+*/
+
+// Times the hot paths of the docking on a receptor and a ligand, by default
+// those of inst/extdata. Not part of the R package: Makevars only compiles
+// vina/main and vina/lib. Once the package has been configured, build it from
+// src with
+//
+//   g++ -O2 -I vina/lib -I boost_deps/boost_build/include vina/bench/bench.cpp vina/lib/*.cpp -L boost_deps/boost_build/lib -lboost_program_options -lboost_thread -lboost_filesystem -lboost_system -o vina_bench
+//
+// Every trial repeats the same work, from the same seed, so that builds can be
+// compared. The results are printed one per line, as tab-separated values or
+// as JSON objects. With --verify, it checks the results of the same paths
+// instead, and exits with 1 if any of them is off.
+
+#include <iostream>
+#include <string>
+#include <exception>
+#include <vector>
+#include <cmath> // for ceil, abs and ldexp
+#include <algorithm> // for min, max and fill
+#include <boost/program_options.hpp>
+#include <boost/filesystem/exception.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
+#include "parse_pdbqt.h"
+#include "cache.h"
+#include "non_cache.h"
+#include "grid.h"
+#include "szv_grid.h"
+#include "everything.h"
+#include "weighted_terms.h"
+#include "precalculate.h"
+#include "monte_carlo.h"
+#include "quasi_newton.h"
+#include "random.h"
+#include "file.h"
+#include "parse_error.h"
+
+using boost::filesystem::path;
+
+path make_path(const std::string& str) {
+	return path(str, boost::filesystem::native);
+}
+
+struct usage_error : public std::runtime_error {
+	usage_error(const std::string& message) : std::runtime_error(message) {}
+};
+
+struct stopwatch {
+	stopwatch() : start(boost::posix_time::microsec_clock::universal_time()) {}
+	fl seconds() const { return (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() * 1e-6; }
+private:
+	boost::posix_time::ptime start;
+};
+
+struct report { // one line per benchmark and trial
+	report(bool json_, int seed_) : json(json_), seed(seed_) {
+		if(!json)
+			std::cout << "benchmark\tparameter\ttrial\tseed\tcount\tseconds\tper_second\n";
+	}
+	void operator()(const std::string& benchmark, fl parameter, sz trial, sz count, fl seconds) const {
+		const fl per_second = (seconds > 0) ? count / seconds : 0;
+		if(json)
+			std::cout << "{\"benchmark\": \"" << benchmark << "\", \"parameter\": " << parameter << ", \"trial\": " << trial
+			          << ", \"seed\": " << seed << ", \"count\": " << count << ", \"seconds\": " << seconds << ", \"per_second\": " << per_second << "}\n";
+		else
+			std::cout << benchmark << '\t' << parameter << '\t' << trial << '\t' << seed << '\t' << count << '\t' << seconds << '\t' << per_second << '\n';
+		std::cout.flush();
+	}
+private:
+	bool json;
+	int seed;
+};
+
+flv default_weights() { // the same as the docking
+	flv weights;
+	weights.push_back(-0.035579); // gauss1
+	weights.push_back(-0.005156); // gauss2
+	weights.push_back( 0.840245); // repulsion
+	weights.push_back(-0.035069); // hydrophobic
+	weights.push_back(-0.587439); // hydrogen
+	weights.push_back(5 * 0.05846 / 0.1 - 1); // rot, see everything.cpp
+	return weights;
+}
+
+grid_dims cube_grid_dims(const vec& center, fl size, fl granularity) {
+	grid_dims gd;
+	VINA_FOR_IN(i, gd) {
+		gd[i].n = sz(std::ceil(size / granularity));
+		fl real_span = granularity * gd[i].n;
+		gd[i].begin = center[i] - real_span/2;
+		gd[i].end = gd[i].begin + real_span;
+	}
+	return gd;
+}
+
+vec heavy_atom_center(const model& m) {
+	const vecv coords = m.get_heavy_atom_movable_coords();
+	VINA_CHECK(!coords.empty());
+	vec tmp(0, 0, 0);
+	VINA_FOR_IN(i, coords)
+		tmp += coords[i];
+	tmp *= 1.0 / coords.size();
+	return tmp;
+}
+
+std::vector<model> random_poses(const model& m, const vec& corner1, const vec& corner2, sz how_many, rng& generator) { // with their coords set
+	std::vector<model> tmp(how_many, m);
+	VINA_FOR_IN(i, tmp) {
+		conf c = m.get_initial_conf();
+		c.randomize(corner1, corner2, generator);
+		tmp[i].set(c);
+	}
+	return tmp;
+}
+
+const fl slope = 1e6; // the same as the docking
+
+monte_carlo bench_monte_carlo(const model& m, sz steps) { // set up as in the docking
+	monte_carlo mc;
+	mc.num_steps = unsigned(steps);
+	mc.ssd_par.evals = unsigned((25 + m.num_movable_atoms()) / 3);
+	mc.min_rmsd = 1.0;
+	mc.num_saved_mins = 20;
+	mc.hunt_cap = vec(10, 10, 10);
+	return mc;
+}
+
+// --verify: the lanes, layouts and storages against the paths they replaced or the bounds grid.h documents
+
+struct model_test { // model lets it at the atoms, coords and forces
+	static void place(model& m, sz i, const vec& location) { m.coords[i] = location; }
+	static const vecv& minus_forces(const model& m) { return m.minus_forces; }
+	static void clear_forces(model& m) {
+		VINA_FOR_IN(i, m.minus_forces)
+			m.minus_forces[i].assign(0);
+	}
+	// non_cache::eval_deriv as it was, atom pair by atom pair. The grid atoms within the cutoff are taken in the order the
+	// szv_grid of non_cache lists them, so that the energies and forces should be the same, bit for bit.
+	static fl non_cache_eval_deriv(const precalculate& p, const grid_dims& gd, fl slope, model& m, fl v) {
+		fl e = 0;
+		const fl cutoff_sqr = p.cutoff_sqr();
+		const sz n = num_atom_types(p.atom_typing_used());
+		VINA_FOR(i, m.num_movable_atoms()) {
+			fl this_e = 0;
+			vec deriv(0, 0, 0);
+			vec out_of_bounds_deriv(0, 0, 0);
+			fl out_of_bounds_penalty = 0;
+			const atom& a = m.atoms[i];
+			const sz t1 = a.get(p.atom_typing_used());
+			if(t1 >= n) {
+				m.minus_forces[i].assign(0);
+				continue;
+			}
+			const vec& a_coords = m.coords[i];
+			vec adjusted_a_coords = a_coords;
+			VINA_FOR_IN(j, gd) {
+				if(gd[j].n > 0) {
+					if(a_coords[j] < gd[j].begin) {
+						adjusted_a_coords[j] = gd[j].begin;
+						out_of_bounds_deriv[j] = -1;
+						out_of_bounds_penalty += std::abs(a_coords[j] - gd[j].begin);
+					}
+					else if(a_coords[j] > gd[j].end) {
+						adjusted_a_coords[j] = gd[j].end;
+						out_of_bounds_deriv[j] = 1;
+						out_of_bounds_penalty += std::abs(a_coords[j] - gd[j].end);
+					}
+				}
+			}
+			out_of_bounds_penalty *= slope;
+			out_of_bounds_deriv *= slope;
+			VINA_FOR_IN(j, m.grid_atoms) {
+				const atom& b = m.grid_atoms[j];
+				const sz t2 = b.get(p.atom_typing_used());
+				if(t2 >= n) continue;
+				vec r_ba; r_ba = adjusted_a_coords - b.coords;
+				const fl r2 = sqr(r_ba);
+				if(r2 < cutoff_sqr) {
+					const pr e_dor = p.eval_deriv(triangular_matrix_index_permissive(n, t1, t2), r2);
+					this_e += e_dor.first;
+					deriv += e_dor.second * r_ba;
+				}
+			}
+			curl(this_e, deriv, v);
+			m.minus_forces[i] = deriv + out_of_bounds_deriv;
+			e += this_e + out_of_bounds_penalty;
+		}
+		return e;
+	}
+	static fl pairs_eval_deriv(const precalculate& p, const vec& v, model& m) { // the interacting pairs of model::eval_deriv, pair by pair; sets m.minus_forces
+		clear_forces(m);
+		fl e = interacting_pairs_deriv(p, v[2], m.other_pairs, m.coords, m.minus_forces);
+		VINA_FOR_IN(i, m.ligands)
+			e += interacting_pairs_deriv(p, v[0], m.ligands[i].pairs, m.coords, m.minus_forces);
+		return e;
+	}
+private:
+	static fl interacting_pairs_deriv(const precalculate& p, fl v, const interacting_pairs& pairs, const vecv& coords, vecv& forces) { // adds to forces
+		const fl cutoff_sqr = p.cutoff_sqr();
+		fl e = 0;
+		VINA_FOR_IN(i, pairs) {
+			const interacting_pair& ip = pairs[i];
+			vec r; r = coords[ip.b] - coords[ip.a]; // a -> b
+			const fl r2 = sqr(r);
+			if(r2 < cutoff_sqr) {
+				pr tmp = p.eval_deriv(ip.type_pair_index, r2);
+				vec force; force = tmp.second * r;
+				curl(tmp.first, force, v);
+				e += tmp.first;
+				forces[ip.a] -= force;
+				forces[ip.b] += force;
+			}
+		}
+		return e;
+	}
+};
+
+struct no_grid : public igrid { // leaves model::eval_deriv with the interacting pairs
+	fl eval      (const model& m, fl v) const { return 0; }
+	fl eval_deriv(      model& m, fl v) const { model_test::clear_forces(m); return 0; }
+};
+
+struct tally { // of the values a check compares
+	sz compared;
+	sz mismatches;
+	fl max_difference;
+	tally() : compared(0), mismatches(0), max_difference(0) {}
+	void operator()(fl a, fl b, fl allowed = 0) { // a and b should be at most allowed apart
+		const fl difference = (a == b) ? 0 : std::abs(a - b); // also for the same infinity
+		++compared;
+		if(!(difference <= allowed)) // NaN included
+			++mismatches;
+		if(difference > max_difference)
+			max_difference = difference;
+	}
+	void operator()(const vec& a, const vec& b, fl allowed = 0) {
+		VINA_FOR(i, 3)
+			(*this)(a[i], b[i], allowed);
+	}
+	void operator()(const vecv& a, const vecv& b) {
+		VINA_CHECK(a.size() == b.size());
+		VINA_FOR_IN(i, a)
+			(*this)(a[i], b[i]);
+	}
+};
+
+struct verification { // one line per check
+	verification(bool json_) : failures(0), json(json_) {
+		if(!json)
+			std::cout << "check\tcompared\tmismatches\tmax_difference\n";
+	}
+	void operator()(const std::string& check, const tally& t) {
+		if(json)
+			std::cout << "{\"check\": \"" << check << "\", \"compared\": " << t.compared << ", \"mismatches\": " << t.mismatches
+			          << ", \"max_difference\": " << t.max_difference << "}\n";
+		else
+			std::cout << check << '\t' << t.compared << '\t' << t.mismatches << '\t' << t.max_difference << '\n';
+		std::cout.flush();
+		if(t.compared == 0 || t.mismatches > 0)
+			++failures;
+	}
+	sz failures;
+private:
+	bool json;
+};
+
+const grid_storage verified_storages[] = { grid_double, grid_float, grid_int16 };
+const char* const storage_names[] = { "double", "float", "int16" };
+const grid_layout verified_layouts[] = { grid_linear, grid_blocked, grid_sparse };
+const char* const layout_names[] = { "linear", "blocked", "sparse" };
+
+fl storage_bound(grid_storage storage, const array3d<fl>& values) { // how far off from grid_double grid.h lets an interpolated value be
+	fl lo = max_fl;
+	fl hi = -max_fl;
+	VINA_FOR(i, values.size()) {
+		lo = (std::min)(lo, values.data()[i]);
+		hi = (std::max)(hi, values.data()[i]);
+	}
+	switch(storage) {
+		case grid_float: return std::ldexp(fl(1), -24) * (std::max)(std::abs(lo), std::abs(hi));
+		case grid_int16: return (hi - lo) / 131068;
+		default: return 0;
+	}
+}
+
+struct saturated_bricks { // of the values of a grid, where grid_sparse keeps only the smallest of each brick
+	saturated_bricks(const array3d<fl>& values)
+		: smallest((values.dim0() + grid_brick - 1) / grid_brick, (values.dim1() + grid_brick - 1) / grid_brick, (values.dim2() + grid_brick - 1) / grid_brick) {
+		std::fill(smallest.data(), smallest.data() + smallest.size(), max_fl);
+		VINA_FOR(x, values.dim0())
+			VINA_FOR(y, values.dim1())
+				VINA_FOR(z, values.dim2()) {
+					fl& s = smallest(x / grid_brick, y / grid_brick, z / grid_brick);
+					s = (std::min)(s, values(x, y, z));
+				}
+	}
+	bool touch(const grid_dims& gd, const vec& location) const { // the cell grid::evaluate interpolates location in
+		boost::array<sz, 3> a;
+		VINA_FOR(i, 3) {
+			const fl s = (location[i] - gd[i].begin) * (gd[i].n / gd[i].span());
+			a[i] = (s < 0) ? 0 : (std::min)(sz(s), gd[i].n - 1);
+		}
+		VINA_FOR(x, 2)
+			VINA_FOR(y, 2)
+				VINA_FOR(z, 2)
+					if(smallest((a[0] + x) / grid_brick, (a[1] + y) / grid_brick, (a[2] + z) / grid_brick) >= grid_saturation)
+						return true;
+		return false;
+	}
+private:
+	array3d<fl> smallest;
+};
+
+// Compares, over the same poses and locations from seed, the grid lanes with grid::evaluate and every storage and layout of
+// a grid with grid_double and grid_linear, within the bounds of grid.h; the caches laid out and populated every other way
+// with those of the same storage laid out linearly; the cache with non_cache at the grid points; and the lanes of
+// non_cache::eval_deriv and model::eval_deriv with the scalar loops they replaced. Returns the number of checks that failed.
+sz verify_paths(const model& m, const weighted_terms& wt, const precalculate& prec, const szv& atom_types, const grid_dims& gd, sz cpu, int seed, bool json) {
+	const sz poses = 1000;
+	const fl vs[] = { 1000, 10, 0.5, max_fl }; // curl as the docking does, harder, and not at all
+	const vec corner1(gd[0].begin, gd[1].begin, gd[2].begin);
+	const vec corner2(gd[0].end,   gd[1].end,   gd[2].end);
+	verification out(json);
+
+	rng generator(static_cast<rng::result_type>(seed));
+	std::vector<conf> confs(poses, m.get_initial_conf());
+	VINA_FOR_IN(i, confs)
+		confs[i].randomize(corner1, corner2, generator);
+	vecv locations(poses * grid_lanes);
+	VINA_FOR_IN(i, locations)
+		VINA_FOR(j, 3)
+			locations[i][j] = random_fl(corner1[j] - 1, corner2[j] + 1, generator); // some out of the box, for its penalty
+
+	{ // a grid per atom type of the ligand, with the values cache::populate gives it
+		const sz nat = num_atom_types(prec.atom_typing_used());
+		const szv_grid ig(m, szv_grid_dims(gd), prec.cutoff_sqr());
+		std::vector<grid> reference(atom_types.size(), grid(gd));
+		VINA_FOR(x, reference[0].m_data.dim0())
+			VINA_FOR(y, reference[0].m_data.dim1())
+				VINA_FOR(z, reference[0].m_data.dim2()) {
+					const vec probe_coords = reference[0].index_to_argument(x, y, z);
+					const szv_grid_atoms possibilities = ig.possibilities(probe_coords);
+					for(const sz* k = possibilities.begin; k != possibilities.end; ++k) {
+						const sz i = *k;
+						const fl r2 = vec_distance_sqr(vec(possibilities.x[i], possibilities.y[i], possibilities.z[i]), probe_coords);
+						if(r2 <= prec.cutoff_sqr())
+							VINA_FOR_IN(t, atom_types)
+								reference[t].m_data(x, y, z) += prec.eval_fast(triangular_matrix_index_permissive(nat, possibilities.type[i], atom_types[t]), r2);
+					}
+				}
+		tally lanes[3][3];
+		tally formats[3][3];
+		VINA_FOR_IN(t, reference) {
+			const saturated_bricks saturated(reference[t].m_data);
+			VINA_FOR(s, 3) {
+				const fl allowed = storage_bound(verified_storages[s], reference[t].m_data) * (1 + 1e-6); // and the rounding of the interpolation
+				VINA_FOR(l, 3) {
+					grid g = reference[t];
+					g.compact(verified_storages[s], verified_layouts[l]);
+					for(sz i = 0; i < locations.size(); i += grid_lanes) {
+						VINA_FOR(k, 4) {
+							grid_batch b;
+							VINA_FOR(j, grid_lanes)
+								g.gather(locations[i + j], slope, b);
+							fl e[grid_lanes];
+							vec deriv[grid_lanes];
+							interpolate(b, slope, vs[k], e, deriv);
+							VINA_FOR(j, grid_lanes) {
+								vec expected_deriv;
+								const fl expected = g.evaluate(locations[i + j], slope, vs[k], expected_deriv);
+								lanes[s][l](e[j], expected);
+								lanes[s][l](deriv[j], expected_deriv);
+							}
+						}
+						VINA_FOR(j, grid_lanes) {
+							const vec& location = locations[i + j];
+							if(verified_layouts[l] == grid_sparse && saturated.touch(gd, location))
+								continue; // where grid_sparse need not match
+							vec deriv;
+							vec expected_deriv;
+							const fl e = g.evaluate(location, slope, max_fl, deriv);
+							const fl expected = reference[t].evaluate(location, slope, max_fl, expected_deriv);
+							formats[s][l](e, expected, allowed);
+							if(verified_storages[s] == grid_double)
+								formats[s][l](deriv, expected_deriv);
+						}
+					}
+				}
+			}
+		}
+		VINA_FOR(s, 3)
+			VINA_FOR(l, 3)
+				out(std::string("interpolate_") + storage_names[s] + "_" + layout_names[l], lanes[s][l]);
+		VINA_FOR(s, 3)
+			VINA_FOR(l, 3)
+				if(s > 0 || l > 0)
+					out(std::string("grid_") + storage_names[s] + "_" + layout_names[l], formats[s][l]);
+	}
+	{ // grid_sparse is left to the grids above, where the saturated bricks are known
+		model tmp = m;
+		VINA_FOR(s, 3) {
+			cache linear("scoring_function_version001", gd, slope, atom_type::XS, verified_storages[s]);
+			linear.populate(m, prec, atom_types, false, cpu);
+			VINA_FOR(l, 2)
+				VINA_FOR(interleave, 2)
+					VINA_FOR(lazy, 2) {
+						if(l == 0 && !interleave && !lazy) continue; // linear itself
+						if(lazy && (verified_storages[s] == grid_int16 || interleave)) continue; // as cache allows
+						cache c("scoring_function_version001", gd, slope, atom_type::XS, verified_storages[s], verified_layouts[l], interleave != 0, grid_trilinear, lazy != 0);
+						c.populate(m, prec, atom_types, false, cpu);
+						tally t;
+						VINA_FOR_IN(i, confs) {
+							tmp.set(confs[i]);
+							VINA_FOR(k, 2) {
+								const fl expected = linear.eval_deriv(tmp, vs[k]);
+								const vecv expected_forces = model_test::minus_forces(tmp);
+								t(c.eval_deriv(tmp, vs[k]), expected);
+								t(model_test::minus_forces(tmp), expected_forces);
+							}
+						}
+						out(std::string("cache_") + storage_names[s] + "_" + layout_names[l] + (interleave ? "_interleaved" : "") + (lazy ? "_lazy" : ""), t);
+					}
+		}
+	}
+	{ // at the grid points, where the cache interpolates nothing; only populate counts the pairs at exactly the cutoff
+		cache c("scoring_function_version001", gd, slope, atom_type::XS);
+		c.populate(m, prec, atom_types, false, cpu);
+		const non_cache nc(m, gd, &prec, slope);
+		model tmp = m;
+		tally t;
+		VINA_FOR(i, poses) {
+			VINA_FOR(j, m.num_movable_atoms()) {
+				vec location;
+				VINA_FOR(d, 3)
+					location[d] = gd[d].begin + (1 / (gd[d].n / gd[d].span())) * random_int(0, int(gd[d].n), generator); // as grid::index_to_argument
+				model_test::place(tmp, j, location);
+			}
+			VINA_FOR(k, 4) {
+				const fl expected = nc.eval(tmp, vs[k]);
+				t(c.eval(tmp, vs[k]), expected, 1e-9 * (1 + std::abs(expected)));
+			}
+		}
+		out("cache_non_cache", t);
+	}
+	{ // with the tables of the docking, and the compact ones of float
+		const precalculate compact(wt, m.get_atom_types(prec.atom_typing_used()));
+		const precalculate* const precs[] = { &prec, &compact };
+		const char* const prec_names[] = { "", "_compact" };
+		VINA_FOR(p, 2) {
+			const non_cache nc(m, gd, precs[p], slope);
+			const no_grid none;
+			model tmp = m;
+			change g(m.get_size());
+			tally grid_atoms;
+			tally pairs;
+			VINA_FOR_IN(i, confs) {
+				VINA_FOR(k, 2) {
+					tmp.set(confs[i]);
+					const fl e = nc.eval_deriv(tmp, vs[k]);
+					const vecv forces = model_test::minus_forces(tmp);
+					grid_atoms(e, model_test::non_cache_eval_deriv(*precs[p], gd, slope, tmp, vs[k]));
+					grid_atoms(forces, model_test::minus_forces(tmp));
+					const vec v(vs[k], vs[k], vs[k]);
+					const fl pairs_e = tmp.eval_deriv(*precs[p], none, v, confs[i], g);
+					const vecv pairs_forces = model_test::minus_forces(tmp);
+					pairs(pairs_e, model_test::pairs_eval_deriv(*precs[p], v, tmp));
+					pairs(pairs_forces, model_test::minus_forces(tmp));
+				}
+			}
+			out(std::string("non_cache_eval_deriv") + prec_names[p], grid_atoms);
+			out(std::string("model_eval_deriv") + prec_names[p], pairs);
+		}
+	}
+	return out.failures;
+}
+
+int main(int argc, char* argv[]) {
+	using namespace boost::program_options;
+	try {
+		std::string rigid_name = "inst/extdata/target.pdbqt", ligand_name = "inst/extdata/ligand.pdbqt", storage_name = "double", layout_name = "linear",
+		            interpolation_name = "trilinear";
+		int seed = 42;
+		sz trials = 3, cpu = 1, grid_evals = 1000000, poses = 10000, minimizations = 1000, mc_steps = 2000;
+		fl size = 20, spacing = 0.375; // the default granularity of the docking
+		std::vector<fl> populate_sizes;
+		bool interleave = false, lazy = false, verify = false, json = false, help = false;
+		options_description inputs("Input");
+		inputs.add_options()
+			("receptor", value<std::string>(&rigid_name), "rigid part of the receptor (PDBQT)")
+			("ligand", value<std::string>(&ligand_name), "ligand (PDBQT); the search space is centered on it")
+		;
+		options_description work("Work (optional)");
+		work.add_options()
+			("seed", value<int>(&seed), "random seed, the same for every trial")
+			("trials", value<sz>(&trials), "number of times each benchmark is repeated")
+			("cpu", value<sz>(&cpu), "threads cache::populate uses")
+			("storage", value<std::string>(&storage_name), "grid storage: double, float or int16")
+			("layout", value<std::string>(&layout_name), "grid layout: linear, blocked or sparse")
+			("interleave", bool_switch(&interleave), "keep the grids of all the atom types of the cache as one")
+			("lazy", bool_switch(&lazy), "compute the bricks of the grids of the cache as they are first needed")
+			("interpolation", value<std::string>(&interpolation_name), "grid interpolation: trilinear or tricubic")
+			("spacing", value<fl>(&spacing), "between the grid points (Angstrom)")
+			("size", value<fl>(&size), "edge of the cubic search space (Angstrom)")
+			("grid_evals", value<sz>(&grid_evals), "grid::evaluate calls per trial")
+			("poses", value<sz>(&poses), "model::set and eval_deriv calls per trial")
+			("minimizations", value<sz>(&minimizations), "BFGS minimizations per trial")
+			("mc_steps", value<sz>(&mc_steps), "Monte Carlo steps per trial")
+			("populate_sizes", value<std::vector<fl> >(&populate_sizes)->multitoken(), "edges of the boxes cache::populate is timed with (default 10 15 20 25)")
+		;
+		options_description info("Information (optional)");
+		info.add_options()
+			("verify", bool_switch(&verify), "check the grid lanes, layouts and storages, the caches and the eval_deriv lanes against their references instead of timing them")
+			("json", bool_switch(&json), "print JSON objects instead of tab-separated values")
+			("help", bool_switch(&help), "print this message")
+		;
+		options_description desc;
+		desc.add(inputs).add(work).add(info);
+
+		variables_map vm;
+		try {
+			store(command_line_parser(argc, argv)
+				.options(desc)
+				.style(command_line_style::default_style ^ command_line_style::allow_guessing)
+				.run(),
+				vm);
+			notify(vm);
+		}
+		catch(boost::program_options::error& e) {
+			std::cerr << "Command line parse error: " << e.what() << '\n' << "\nCorrect usage:\n" << desc << '\n';
+			return 1;
+		}
+		if(help) {
+			std::cout << desc << '\n';
+			return 0;
+		}
+		if(populate_sizes.empty())
+			for(fl s = 10; s <= 25; s += 5)
+				populate_sizes.push_back(s);
+		if(trials < 1 || cpu < 1 || size <= 0 || spacing <= 0)
+			throw usage_error("trials, cpu, size and spacing should be positive");
+		grid_storage storage = grid_double;
+		if(storage_name == "float")
+			storage = grid_float;
+		else if(storage_name == "int16")
+			storage = grid_int16;
+		else if(storage_name != "double")
+			throw usage_error("storage should be double, float or int16");
+		grid_layout layout = grid_linear;
+		if(layout_name == "blocked")
+			layout = grid_blocked;
+		else if(layout_name == "sparse")
+			layout = grid_sparse;
+		else if(layout_name != "linear")
+			throw usage_error("layout should be linear, blocked or sparse");
+		grid_interpolation interpolation = grid_trilinear;
+		if(interpolation_name == "tricubic")
+			interpolation = grid_tricubic;
+		else if(interpolation_name != "trilinear")
+			throw usage_error("interpolation should be trilinear or tricubic");
+		if(lazy && (storage == grid_int16 || layout == grid_sparse || interleave))
+			throw usage_error("lazy works with the double and float storage, and neither the sparse layout nor interleave");
+
+		model m = parse_receptor_pdbqt(make_path(rigid_name));
+		const model ligand = parse_ligand_pdbqt(make_path(ligand_name));
+		m.append(ligand);
+		const vec center = heavy_atom_center(ligand);
+
+		everything t;
+		weighted_terms wt(&t, default_weights());
+		const precalculate prec(wt);
+		const szv atom_types = m.get_movable_atom_types(prec.atom_typing_used());
+		const vec authentic_v(1000, 1000, 1000);
+
+		const grid_dims gd = cube_grid_dims(center, size, spacing);
+		const vec corner1(gd[0].begin, gd[1].begin, gd[2].begin);
+		const vec corner2(gd[0].end,   gd[1].end,   gd[2].end);
+		if(verify) {
+			const sz failures = verify_paths(m, wt, prec, atom_types, gd, cpu, seed, json);
+			if(failures > 0) {
+				std::cerr << "\n\nVerification failed: " << failures << " check" << (failures > 1 ? "s" : "") << " found mismatches.\n";
+				return 1;
+			}
+			return 0;
+		}
+		cache c("scoring_function_version001", gd, slope, atom_type::XS, storage, layout, interleave, interpolation);
+		c.populate(m, prec, atom_types, false); // never lazy, so that the trials compare
+		const non_cache nc(m, gd, &prec, slope);
+
+		report out(json, seed);
+		VINA_FOR(trial, trials) {
+			{ // one grid, filled with noise: only the interpolation matters
+				rng generator(static_cast<rng::result_type>(seed));
+				grid g(gd);
+				VINA_FOR(x, g.m_data.dim0())
+					VINA_FOR(y, g.m_data.dim1())
+						VINA_FOR(z, g.m_data.dim2())
+							g.m_data(x, y, z) = random_fl(-1, 1, generator);
+				g.compact(storage, layout);
+				g.set_interpolation(interpolation);
+				vecv locations(1024);
+				VINA_FOR_IN(i, locations)
+					VINA_FOR(j, 3)
+						locations[i][j] = random_fl(corner1[j], corner2[j], generator);
+				fl sum = 0;
+				vec deriv;
+				stopwatch sw;
+				VINA_FOR(i, grid_evals)
+					sum += g.evaluate(locations[i % locations.size()], slope, authentic_v[0], deriv);
+				const fl seconds = sw.seconds();
+				VINA_CHECK(sum == sum); // keeps the loop
+				out("grid_evaluate", size, trial, grid_evals, seconds);
+			}
+			{
+				rng generator(static_cast<rng::result_type>(seed));
+				std::vector<conf> confs(poses, m.get_initial_conf());
+				VINA_FOR_IN(i, confs)
+					confs[i].randomize(corner1, corner2, generator);
+				model tmp = m;
+				stopwatch sw;
+				VINA_FOR_IN(i, confs)
+					tmp.set(confs[i]);
+				out("model_set", size, trial, poses, sw.seconds());
+			}
+			{
+				rng generator(static_cast<rng::result_type>(seed));
+				std::vector<model> models = random_poses(m, corner1, corner2, 16, generator);
+				fl sum = 0;
+				{
+					stopwatch sw;
+					VINA_FOR(i, poses)
+						sum += c.eval_deriv(models[i % models.size()], authentic_v[0]);
+					out("cache_eval_deriv", size, trial, poses, sw.seconds());
+				}
+				{
+					stopwatch sw;
+					VINA_FOR(i, poses)
+						sum += nc.eval_deriv(models[i % models.size()], authentic_v[0]);
+					out("non_cache_eval_deriv", size, trial, poses, sw.seconds());
+				}
+				VINA_CHECK(sum == sum);
+			}
+			{
+				rng generator(static_cast<rng::result_type>(seed));
+				std::vector<output_type> starts;
+				VINA_FOR(i, minimizations) {
+					output_type tmp(m.get_size(), 0);
+					tmp.c.randomize(corner1, corner2, generator);
+					starts.push_back(tmp);
+				}
+				quasi_newton quasi_newton_par;
+				quasi_newton_par.max_steps = unsigned((25 + m.num_movable_atoms()) / 3); // as in the Monte Carlo search
+				model tmp = m;
+				change g(m.get_size());
+				stopwatch sw;
+				VINA_FOR_IN(i, starts)
+					quasi_newton_par(tmp, prec, c, starts[i], g, authentic_v);
+				out("bfgs", size, trial, minimizations, sw.seconds());
+			}
+			{
+				const monte_carlo mc = bench_monte_carlo(m, mc_steps);
+				rng generator(static_cast<rng::result_type>(seed));
+				model tmp = m;
+				output_container mc_out;
+				stopwatch sw;
+				mc(tmp, mc_out, prec, c, prec, c, corner1, corner2, NULL, generator);
+				out("monte_carlo_steps", size, trial, mc_steps, sw.seconds());
+			}
+			VINA_FOR_IN(i, populate_sizes) {
+				const grid_dims box = cube_grid_dims(center, populate_sizes[i], spacing);
+				{ // its szv_grid, as set up by every docking
+					stopwatch sw;
+					const non_cache box_nc(m, box, &prec, slope);
+					out("non_cache_setup", populate_sizes[i], trial, 1, sw.seconds());
+				}
+				{
+					cache box_cache("scoring_function_version001", box, slope, atom_type::XS, storage, layout, interleave, interpolation, lazy);
+					stopwatch sw;
+					box_cache.populate(m, prec, atom_types, false, cpu);
+					out("cache_populate", populate_sizes[i], trial, atom_types.size(), sw.seconds());
+				}
+				{ // the time to a first result, over the whole box
+					cache box_cache("scoring_function_version001", box, slope, atom_type::XS, storage, layout, interleave, interpolation, lazy);
+					const monte_carlo mc = bench_monte_carlo(m, mc_steps);
+					rng generator(static_cast<rng::result_type>(seed));
+					model tmp = m;
+					output_container mc_out;
+					stopwatch sw;
+					box_cache.populate(m, prec, atom_types, false, cpu);
+					mc(tmp, mc_out, prec, box_cache, prec, box_cache, vec(box[0].begin, box[1].begin, box[2].begin), vec(box[0].end, box[1].end, box[2].end), NULL, generator);
+					out("populate_monte_carlo", populate_sizes[i], trial, mc_steps, sw.seconds());
+				}
+			}
+		}
+	}
+	catch(file_error& e) {
+		std::cerr << "\n\nError: could not open \"" << e.name.native_file_string() << "\" for " << (e.in ? "reading" : "writing") << ".\n";
+		return 1;
+	}
+	catch(boost::filesystem::filesystem_error& e) {
+		std::cerr << "\n\nFile system error: " << e.what() << '\n';
+		return 1;
+	}
+	catch(usage_error& e) {
+		std::cerr << "\n\nUsage error: " << e.what() << ".\n";
+		return 1;
+	}
+	catch(parse_error& e) {
+		std::cerr << "\n\nParse error on line " << e.line << " in file \"" << e.file.native_file_string() << "\": " << e.reason << '\n';
+		return 1;
+	}
+	catch(std::bad_alloc&) {
+		std::cerr << "\n\nError: insufficient memory!\n";
+		return 1;
+	}
+	catch(std::exception& e) {
+		std::cerr << "\n\nAn error occurred: " << e.what() << ".\n";
+		return 1;
+	}
+	catch(internal_error& e) {
+		std::cerr << "\n\nAn internal error occurred in " << e.file << "(" << e.line << ").\n";
+		return 1;
+	}
+	return 0;
+}
@@ -70,6 +70,15 @@ public:
 		m_k = k;
 		m_data.resize(checked_multiply(i, j, k));
 	}
+	void swap(array3d& other) { // without copying the elements
+		std::swap(m_i, other.m_i);
+		std::swap(m_j, other.m_j);
+		std::swap(m_k, other.m_k);
+		m_data.swap(other.m_data);
+	}
+	sz size() const { return m_data.size(); }
+	T*       data()       { return m_data.empty() ? NULL : &m_data[0]; } // all the elements, contiguous
+	const T* data() const { return m_data.empty() ? NULL : &m_data[0]; }
 	T&       operator()(sz i, sz j, sz k)       { return m_data[i + m_i*(j + m_j*k)]; }
 	const T& operator()(sz i, sz j, sz k) const { return m_data[i + m_i*(j + m_j*k)]; }
 };
@@ -27,6 +27,18 @@
 
 typedef triangular_matrix<fl> flmat;
 
+struct bfgs_counters { // the work done by the optimizations, for profiling
+	unsigned long evals; // of the function and its gradient
+	unsigned long steps;
+	unsigned long trials; // of the line search
+	bfgs_counters() : evals(0), steps(0), trials(0) {}
+	void add(const bfgs_counters& x) {
+		evals  += x.evals;
+		steps  += x.steps;
+		trials += x.trials;
+	}
+};
+
 template<typename Change>
 void minus_mat_vec_product(const flmat& m, const Change& in, Change& out) {
 	sz n = m.dim();
@@ -63,7 +75,7 @@ inline bool bfgs_update(flmat& h, const Change& p, const Change& y, const fl alp
 }
 
 template<typename F, typename Conf, typename Change>
-fl line_search(F& f, sz n, const Conf& x, const Change& g, const fl f0, const Change& p, Conf& x_new, Change& g_new, fl& f1) { // returns alpha
+fl line_search(F& f, sz n, const Conf& x, const Change& g, const fl f0, const Change& p, Conf& x_new, Change& g_new, fl& f1, bfgs_counters* counters) { // returns alpha
 	const fl c0 = 0.0001;
 	const unsigned max_trials = 10;
 	const fl multiplier = 0.5;
@@ -74,6 +86,10 @@ fl line_search(F& f, sz n, const Conf& x, const Change& g, const fl f0, const Ch
 	VINA_U_FOR(trial, max_trials) {
 		x_new = x; x_new.increment(p, alpha);
 		f1 = f(x_new, g_new);
+		if(counters) {
+			++counters->evals;
+			++counters->trials;
+		}
 		if(f1 - f0 < c0 * alpha * pg) // FIXME check - div by norm(p) ? no?
 			break;
 		alpha *= multiplier;
@@ -93,7 +109,7 @@ void subtract_change(Change& b, const Change& a, sz n) { // b -= a
 }
 
 template<typename F, typename Conf, typename Change>
-fl bfgs(F& f, Conf& x, Change& g, const unsigned max_steps, const fl average_required_improvement, const sz over) { // x is I/O, final value is returned
+fl bfgs(F& f, Conf& x, Change& g, const unsigned max_steps, const fl average_required_improvement, const sz over, bfgs_counters* counters = NULL) { // x is I/O, final value is returned
 	sz n = g.num_floats();
 	flmat h(n, 0);
 	set_diagonal(h, 1);
@@ -101,6 +117,8 @@ fl bfgs(F& f, Conf& x, Change& g, const unsigned max_steps, const fl average_req
 	Change g_new(g);
 	Conf x_new(x);
 	fl f0 = f(x, g);
+	if(counters)
+		++counters->evals;
 
 	fl f_orig = f0;
 	Change g_orig(g);
@@ -114,7 +132,9 @@ fl bfgs(F& f, Conf& x, Change& g, const unsigned max_steps, const fl average_req
 	VINA_U_FOR(step, max_steps) {
 		minus_mat_vec_product(h, g, p);
 		fl f1 = 0;
-		const fl alpha = line_search(f, n, x, g, f0, p, x_new, g_new, f1);
+		const fl alpha = line_search(f, n, x, g, f0, p, x_new, g_new, f1, counters);
+		if(counters)
+			++counters->steps;
 		Change y(g_new); subtract_change(y, g, n);
 
 		f_values.push_back(f1);
@@ -21,29 +21,22 @@
 */
 
 #include <algorithm> // fill, etc
+#include <sstream> // file_name
+#include <iomanip>
 
-#if 0 // use binary cache
-	// for some reason, binary archive gives four huge warnings in VC2008
-	#include <boost/archive/binary_oarchive.hpp>
-	#include <boost/archive/binary_iarchive.hpp>
-	typedef boost::archive::binary_iarchive iarchive;
-	typedef boost::archive::binary_oarchive oarchive;
-#else // use text cache
-	#include <boost/archive/text_oarchive.hpp>
-	#include <boost/archive/text_iarchive.hpp>
-	typedef boost::archive::text_iarchive iarchive;
-	typedef boost::archive::text_oarchive oarchive;
-#endif 
-
-#include <boost/serialization/split_member.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/static_assert.hpp>
 #include "cache.h"
 #include "file.h"
 #include "szv_grid.h"
+#include "parallel.h"
 
-cache::cache(const std::string& scoring_function_version_, const grid_dims& gd_, fl slope_, atom_type::t atom_typing_used_) 
-: scoring_function_version(scoring_function_version_), gd(gd_), slope(slope_), atu(atom_typing_used_), grids(num_atom_types(atom_typing_used_)) {}
+cache::cache(const std::string& scoring_function_version_, const grid_dims& gd_, fl slope_, atom_type::t atom_typing_used_, grid_storage storage_,
+             grid_layout layout_, bool interleave_, grid_interpolation interpolation_, bool lazy_) 
+: scoring_function_version(scoring_function_version_), gd(gd_), slope(slope_), atu(atom_typing_used_), storage(storage_), layout(layout_), interleave(interleave_),
+  interpolation(interpolation_), lazy(lazy_),
+  grids(num_atom_types(atom_typing_used_)), channels(num_atom_types(atom_typing_used_), max_sz) {}
 
 fl cache::eval      (const model& m, fl v) const { // needs m.coords
 	fl e = 0;
@@ -53,9 +46,9 @@ fl cache::eval      (const model& m, fl v) const { // needs m.coords
 		const atom& a = m.atoms[i];
 		sz t = a.get(atu);
 		if(t >= nat) continue;
-		const grid& g = grids[t];
+		const grid& g = interleave ? interleaved : grids[t];
 		assert(g.initialized());
-		e += g.evaluate(m.coords[i], slope, v);
+		e += g.evaluate(m.coords[i], slope, v, interleave ? channels[t] : 0);
 	}
 	return e;
 }
@@ -64,99 +57,402 @@ fl cache::eval_deriv(      model& m, fl v) const { // needs m.coords, sets m.min
 	fl e = 0;
 	sz nat = num_atom_types(atu);
 
+	if(interpolation != grid_trilinear) { // interpolate() only blends the corners of the cells
+		VINA_FOR(i, m.num_movable_atoms()) {
+			const atom& a = m.atoms[i];
+			sz t = a.get(atu);
+			if(t >= nat) { m.minus_forces[i].assign(0); continue; }
+			const grid& g = interleave ? interleaved : grids[t];
+			assert(g.initialized());
+			e += g.evaluate(m.coords[i], slope, v, m.minus_forces[i], interleave ? channels[t] : 0);
+		}
+		return e;
+	}
+
+	grid_batch b; // the atoms are interpolated grid_lanes at a time, with the same results as grid::evaluate
+	sz batch_atoms[grid_lanes];
+	fl batch_e[grid_lanes];
+	vec batch_deriv[grid_lanes];
 	VINA_FOR(i, m.num_movable_atoms()) {
 		const atom& a = m.atoms[i];
 		sz t = a.get(atu);
-		if(t >= nat) { m.minus_forces[i].assign(0); continue; }
-		const grid& g = grids[t];
-		assert(g.initialized());
-		vec deriv;
-		e += g.evaluate(m.coords[i], slope, v, deriv);
-		m.minus_forces[i] = deriv;
+		if(t >= nat)
+			m.minus_forces[i].assign(0);
+		else {
+			const grid& g = interleave ? interleaved : grids[t];
+			assert(g.initialized());
+			batch_atoms[b.size] = i;
+			g.gather(m.coords[i], slope, b, interleave ? channels[t] : 0);
+		}
+		if(b.size == grid_lanes || (b.size > 0 && i + 1 == m.num_movable_atoms())) {
+			interpolate(b, slope, v, batch_e, batch_deriv);
+			VINA_FOR(k, b.size) {
+				e += batch_e[k];
+				m.minus_forces[batch_atoms[k]] = batch_deriv[k];
+			}
+			b.size = 0;
+		}
 	}
 	return e;
 }
 
-#if 0 // No longer doing I/O of the cache
-void cache::read(const path& p) {
-	ifile in(p, std::ios::binary);
-	iarchive ar(in);
-	ar >> *this;
+// Grid files are in the native binary format: a header of 8-byte fields, then every grid: its number of
+// channels, the atom type of each, with grid_sparse a byte per brick, 1 if its points share their values, the
+// offset and the scale of each channel with grid_int16, and then its values as they are stored, contiguous and
+// in the order of the layout. The values start on 8-byte boundaries, so that
+// the file could also be mapped into memory as is. An interleaved cache has a single grid.
+
+typedef boost::uint64_t grid_file_word;
+
+const char grid_file_magic[] = "VINAGRD3";
+const grid_file_word grid_file_byte_order = (grid_file_word(0x01020304) << 32) | 0x05060708; // read back differently on a machine of another endianness
+
+struct fnv_hash { // FNV-1a, 64 bits
+	grid_file_word value;
+	fnv_hash() : value((grid_file_word(0xcbf29ce4) << 32) | 0x84222325) {}
+	void add(const void* data, sz size) {
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		VINA_FOR(i, size) {
+			value ^= bytes[i];
+			value *= (grid_file_word(0x00000100) << 32) | 0x000001b3;
+		}
+	}
+	void add(grid_file_word x) { add(&x, sizeof(x)); }
+	void add(fl x) { add(&x, sizeof(x)); }
+	void add(const std::string& x) { add(grid_file_word(x.size())); add(x.data(), x.size()); }
+};
+
+grid_file_word grid_atoms_hash(const atomv& atoms, atom_type::t atu) { // everything the grids depend on, for given gd and scoring function
+	fnv_hash h;
+	h.add(grid_file_word(atoms.size()));
+	VINA_FOR_IN(i, atoms) {
+		h.add(grid_file_word(atoms[i].get(atu)));
+		VINA_FOR(j, 3)
+			h.add(atoms[i].coords[j]);
+	}
+	return h.value;
 }
 
-void cache::write(const path& p) const {
-	ofile out(p, std::ios::binary);
-	oarchive ar(out);
-	ar << *this;
+void write_word(std::ostream& out, grid_file_word x) { out.write(reinterpret_cast<const char*>(&x), sizeof(x)); }
+void write_fl  (std::ostream& out, fl x)             { out.write(reinterpret_cast<const char*>(&x), sizeof(x)); }
+
+grid_file_word read_word(std::istream& in) {
+	grid_file_word x = 0;
+	in.read(reinterpret_cast<char*>(&x), sizeof(x));
+	if(!in) throw cache_mismatch(); // truncated
+	return x;
 }
-#endif
-
-template<class Archive>
-void cache::save(Archive& ar, const unsigned version) const {
-	ar & scoring_function_version;
-	ar & gd;
-	ar & atu;
-	ar & grids;
+
+fl read_fl(std::istream& in) {
+	fl x = 0;
+	in.read(reinterpret_cast<char*>(&x), sizeof(x));
+	if(!in) throw cache_mismatch();
+	return x;
 }
 
-template<class Archive>
-void cache::load(Archive& ar, const unsigned version) {
-	std::string name_tmp;       ar & name_tmp;       if(name_tmp != scoring_function_version) throw energy_mismatch();
-	grid_dims   gd_tmp;         ar &   gd_tmp;       if(!eq(gd_tmp, gd))                    throw grid_dims_mismatch();
-	atom_type::t atu_tmp;       ar &  atu_tmp;       if(atu_tmp != atu)                       throw cache_mismatch();
+template<typename T>
+void write_values(std::ostream& out, const T* values, sz n) { // padded to 8 bytes
+	const sz size = n * sizeof(T);
+	out.write(reinterpret_cast<const char*>(values), size);
+	VINA_FOR(i, (8 - size % 8) % 8)
+		out.put('\0');
+}
 
-	ar & grids;
+template<typename T>
+void read_values(std::istream& in, T* values, sz n) {
+	const sz size = n * sizeof(T);
+	in.read(reinterpret_cast<char*>(values), size);
+	char padding[8];
+	in.read(padding, (8 - size % 8) % 8);
+	if(!in) throw cache_mismatch();
 }
 
-void cache::populate(const model& m, const precalculate& p, const szv& atom_types_needed, bool display_progress) {
-	szv needed;
-	VINA_FOR_IN(i, atom_types_needed) {
-		sz t = atom_types_needed[i];
-		if(!grids[t].initialized()) {
-			needed.push_back(t);
-			grids[t].init(gd);
+std::string cache::file_name(const model& m) const {
+	fnv_hash h;
+	h.add(grid_atoms_hash(m.grid_atoms, atu));
+	h.add(scoring_function_version);
+	h.add(grid_file_word(atu));
+	h.add(grid_file_word(storage));
+	h.add(grid_file_word(layout));
+	h.add(grid_file_word(interleave));
+	VINA_FOR_IN(i, gd) {
+		h.add(gd[i].begin);
+		h.add(gd[i].end);
+		h.add(grid_file_word(gd[i].n));
+	}
+	std::ostringstream out;
+	out << std::hex << std::setfill('0') << std::setw(16) << h.value << ".grids";
+	return out.str();
+}
+
+void cache::write(const path& name, const model& m) const {
+	ofile out(name, std::ios::binary);
+	out.write(grid_file_magic, 8);
+	write_word(out, grid_file_byte_order);
+	write_word(out, grid_file_word(storage));
+	write_word(out, grid_file_word(layout));
+	write_word(out, grid_file_word(interleave));
+	write_word(out, grid_atoms_hash(m.grid_atoms, atu));
+	write_word(out, grid_file_word(atu));
+	VINA_FOR_IN(i, gd) {
+		write_fl(out, gd[i].begin);
+		write_fl(out, gd[i].end);
+		write_word(out, grid_file_word(gd[i].n));
+	}
+	write_word(out, grid_file_word(scoring_function_version.size()));
+	out.write(scoring_function_version.data(), scoring_function_version.size());
+	VINA_FOR(i, (8 - scoring_function_version.size() % 8) % 8)
+		out.put('\0');
+
+	std::vector<const grid*> written;
+	std::vector<szv> types; // of their channels
+	if(interleave) {
+		if(interleaved.initialized()) {
+			written.push_back(&interleaved);
+			types.push_back(szv(interleaved.channels()));
+			VINA_FOR_IN(t, channels)
+				if(channels[t] < max_sz)
+					types.back()[channels[t]] = t;
 		}
 	}
-	if(needed.empty())
-		return;
-	flv affinities(needed.size());
+	else
+		VINA_FOR_IN(t, grids)
+			if(grids[t].initialized() && !grids[t].lazy()) {
+				written.push_back(&grids[t]);
+				types.push_back(szv(1, t));
+			}
+	write_word(out, grid_file_word(written.size()));
+	VINA_FOR_IN(i, written) {
+		const grid& g = *written[i];
+		write_word(out, grid_file_word(g.channels()));
+		VINA_FOR_IN(c, types[i])
+			write_word(out, grid_file_word(types[i][c]));
+		if(layout == grid_sparse) {
+			std::vector<char> constant(g.m_brick_keep.size());
+			VINA_FOR_IN(b, constant)
+				constant[b] = !g.m_brick_keep[b];
+			write_values(out, &constant[0], constant.size());
+		}
+		switch(storage) {
+			case grid_float: write_values(out, &g.m_data_float[0], g.values()); break;
+			case grid_int16:
+				VINA_FOR(c, g.channels()) {
+					write_fl(out, g.m_int16_offset[c]);
+					write_fl(out, g.m_int16_scale[c]);
+				}
+				write_values(out, &g.m_data_int16[0], g.values());
+				break;
+			default: write_values(out, g.m_data.data(), g.values());
+		}
+	}
+	if(!out)
+		throw file_error(name, false);
+}
 
-	sz nat = num_atom_types(atu);
+void cache::read(const path& name, const model& m) {
+	ifile in(name, std::ios::binary);
+	char magic[8];
+	in.read(magic, 8);
+	if(!in || !std::equal(magic, magic + 8, grid_file_magic)) throw cache_mismatch();
+	if(read_word(in) != grid_file_byte_order)               throw cache_mismatch();
+	if(read_word(in) != grid_file_word(storage))            throw cache_mismatch();
+	if(read_word(in) != grid_file_word(layout))             throw cache_mismatch();
+	if(read_word(in) != grid_file_word(interleave))         throw cache_mismatch();
+	if(read_word(in) != grid_atoms_hash(m.grid_atoms, atu)) throw rigid_mismatch();
+	if(read_word(in) != grid_file_word(atu))                throw cache_mismatch();
+	grid_dims gd_tmp;
+	VINA_FOR_IN(i, gd_tmp) {
+		gd_tmp[i].begin = read_fl(in);
+		gd_tmp[i].end   = read_fl(in);
+		gd_tmp[i].n     = sz(read_word(in));
+	}
+	if(!eq(gd_tmp, gd)) throw grid_dims_mismatch();
+	const grid_file_word version_size = read_word(in);
+	if(version_size != scoring_function_version.size()) throw energy_mismatch();
+	std::string version(sz(version_size + (8 - version_size % 8) % 8), '\0');
+	in.read(&version[0], version.size());
+	if(!in || version.substr(0, sz(version_size)) != scoring_function_version) throw energy_mismatch();
 
-	grid& g = grids[needed.front()];
+	std::vector<grid> tmp(grids.size()); // so that a truncated file leaves the cache as it was
+	grid tmp_interleaved;
+	szv tmp_channels(grids.size(), max_sz);
+	const grid_file_word count = read_word(in);
+	if(interleave && count > 1) throw cache_mismatch();
+	VINA_FOR(i, count) {
+		const grid_file_word num_channels = read_word(in);
+		if(num_channels < 1 || num_channels > tmp.size() || (!interleave && num_channels != 1)) throw cache_mismatch();
+		szv types;
+		VINA_FOR(c, num_channels) {
+			const grid_file_word t = read_word(in);
+			if(t >= tmp.size() || tmp[sz(t)].initialized() || tmp_channels[sz(t)] < max_sz) throw cache_mismatch();
+			types.push_back(sz(t));
+			if(interleave)
+				tmp_channels[sz(t)] = c;
+		}
+		grid& g = interleave ? tmp_interleaved : tmp[types.front()];
+		g.init(gd, storage, layout, sz(num_channels));
+		g.set_interpolation(interpolation);
+		if(layout == grid_sparse) {
+			std::vector<char> constant(g.m_brick_keep.size());
+			read_values(in, &constant[0], constant.size());
+			g.place_bricks(constant);
+		}
+		switch(storage) {
+			case grid_float: read_values(in, &g.m_data_float[0], g.values()); break;
+			case grid_int16:
+				VINA_FOR(c, num_channels) {
+					g.m_int16_offset[c] = read_fl(in);
+					g.m_int16_scale[c]  = read_fl(in);
+				}
+				read_values(in, &g.m_data_int16[0], g.values());
+				break;
+			default: read_values(in, g.m_data.data(), g.values());
+		}
+	}
+	if(interleave) {
+		if(tmp_interleaved.initialized() && !interleaved.initialized()) {
+			interleaved.swap(tmp_interleaved);
+			channels = tmp_channels;
+		}
+	}
+	else
+		VINA_FOR_IN(t, tmp)
+			if(tmp[t].initialized() && !grids[t].initialized())
+				grids[t].swap(tmp[t]);
+}
+
+void cache::add_to_interleaved(const szv& types) {
+	std::vector<const grid*> from;
+	szv from_channels;
+	szv channels_tmp(channels.size(), max_sz);
+	VINA_FOR_IN(t, channels) // those already there come first
+		if(channels[t] < max_sz) {
+			channels_tmp[t] = from.size();
+			from.push_back(&interleaved);
+			from_channels.push_back(channels[t]);
+		}
+	VINA_FOR_IN(i, types) {
+		channels_tmp[types[i]] = from.size();
+		from.push_back(&grids[types[i]]);
+		from_channels.push_back(0);
+	}
+	grid tmp;
+	tmp.interleave(from, from_channels);
+	interleaved.swap(tmp);
+	channels = channels_tmp;
+	VINA_FOR_IN(i, types)
+		grid().swap(grids[types[i]]);
+}
 
+void affinities_at(const vec& probe_coords, const precalculate& p, const szv_grid& ig, const szv& types, atom_type::t atu, fl* affinities) { // of each of types
+	const sz nat = num_atom_types(atu);
 	const fl cutoff_sqr = p.cutoff_sqr();
+	std::fill(affinities, affinities + types.size(), 0);
+	const szv_grid_atoms possibilities = ig.possibilities(probe_coords);
+	for(const sz* k = possibilities.begin; k != possibilities.end; ++k) {
+		const sz i = *k;
+		const sz t1 = possibilities.type[i];
+		const fl r2 = vec_distance_sqr(vec(possibilities.x[i], possibilities.y[i], possibilities.z[i]), probe_coords);
+		if(r2 <= cutoff_sqr) {
+			VINA_FOR_IN(j, types) {
+				const sz t2 = types[j];
+				assert(t2 < nat);
+				const sz type_pair_index = triangular_matrix_index_permissive(num_atom_types(atu), t1, t2);
+				affinities[j] += p.eval_fast(type_pair_index, r2);
+			}
+		}
+	}
+}
 
-	grid_dims gd_reduced = szv_grid_dims(gd);
-	szv_grid ig(m, gd_reduced, cutoff_sqr);
+struct lazy_population { // ig holds copies of the receptor atoms, so the model populate was given need not outlive the cache
+	const precalculate* p;
+	szv_grid ig;
+	atom_type::t atu;
+	lazy_population(const model& m, const precalculate* p_, const grid_dims& gd, atom_type::t atu_)
+		: p(p_), ig(m, szv_grid_dims(gd), p_->cutoff_sqr()), atu(atu_) {}
+};
+
+struct lazy_filler : public grid_filler { // of the grids of the atom types populated together
+	boost::shared_ptr<const lazy_population> from;
+	szv types;
+	lazy_filler(const boost::shared_ptr<const lazy_population>& from_, const szv& types_) : from(from_), types(types_) {}
+	void operator()(const vec& location, fl* values) const {
+		affinities_at(location, *from->p, from->ig, types, from->atu, values);
+	}
+};
 
-	VINA_FOR(x, g.m_data.dim0()) {
+struct populate_aux { // fills the x slabs of the grids it is given; each grid point is independent of the others, so the slabs can be filled in any order
+	const precalculate* p;
+	const szv_grid* ig;
+	const szv* needed;
+	std::vector<grid>* grids;
+	atom_type::t atu;
+	populate_aux(const precalculate* p_, const szv_grid* ig_, const szv* needed_, std::vector<grid>* grids_, atom_type::t atu_)
+		: p(p_), ig(ig_), needed(needed_), grids(grids_), atu(atu_) {}
+	void operator()(sz x) const {
+		const szv& needed_ = *needed;
+		flv affinities(needed_.size());
+		const sz nat = num_atom_types(atu);
+		const grid& g = (*grids)[needed_.front()];
 		VINA_FOR(y, g.m_data.dim1()) {
 			VINA_FOR(z, g.m_data.dim2()) {
-				std::fill(affinities.begin(), affinities.end(), 0);
-				vec probe_coords; probe_coords = g.index_to_argument(x, y, z);
-				const szv& possibilities = ig.possibilities(probe_coords);
-				VINA_FOR_IN(possibilities_i, possibilities) {
-					const sz i = possibilities[possibilities_i];
-					const atom& a = m.grid_atoms[i];
-					const sz t1 = a.get(atu);
-					if(t1 >= nat) continue;
-					const fl r2 = vec_distance_sqr(a.coords, probe_coords);
-					if(r2 <= cutoff_sqr) {
-						VINA_FOR_IN(j, needed) {
-							const sz t2 = needed[j];
-							assert(t2 < nat);
-							const sz type_pair_index = triangular_matrix_index_permissive(num_atom_types(atu), t1, t2);
-							affinities[j] += p.eval_fast(type_pair_index, r2);
-						}
-					}
-				}
-				VINA_FOR_IN(j, needed) {
-					sz t = needed[j];
+				affinities_at(g.index_to_argument(x, y, z), *p, *ig, needed_, atu, &affinities[0]);
+				VINA_FOR_IN(j, needed_) {
+					sz t = needed_[j];
 					assert(t < nat);
-					grids[t].m_data(x, y, z) = affinities[j];
+					(*grids)[t].m_data(x, y, z) = affinities[j];
 				}
 			}
 		}
 	}
+};
+
+sz cache::populate(const model& m, const precalculate& p, const szv& atom_types_needed, bool display_progress, sz num_threads) {
+	szv needed;
+	VINA_FOR_IN(i, atom_types_needed) {
+		sz t = atom_types_needed[i];
+		if(!populated(t))
+			needed.push_back(t);
+	}
+	if(needed.empty())
+		return 0;
+	VINA_CHECK(m.atom_typing_used() == atu); // the szv_grid holds the receptor types in the typing of m
+
+	if(lazy) {
+		VINA_CHECK(storage != grid_int16 && layout != grid_sparse && !interleave);
+		if(!lazy_from)
+			lazy_from.reset(new lazy_population(m, &p, gd, atu));
+		std::vector<grid*> lazy_grids;
+		VINA_FOR_IN(j, needed) {
+			grid& g = grids[needed[j]];
+			g.init(gd, storage, layout);
+			g.set_interpolation(interpolation);
+			lazy_grids.push_back(&g);
+		}
+		grid::fill_lazily(lazy_grids, boost::shared_ptr<const grid_filler>(new lazy_filler(lazy_from, needed)));
+		return needed.size();
+	}
+
+	VINA_FOR_IN(j, needed) {
+		grids[needed[j]].init(gd);
+		grids[needed[j]].set_interpolation(interpolation);
+	}
+
+	grid_dims gd_reduced = szv_grid_dims(gd);
+	szv_grid ig(m, gd_reduced, p.cutoff_sqr());
+
+	populate_aux aux(&p, &ig, &needed, &grids, atu);
+	const sz num_slabs = grids[needed.front()].m_data.dim0();
+	if(num_threads > 1 && num_slabs > 1) {
+		parallel_for<populate_aux, true> parallel_for_instance(&aux, (std::min)(num_threads, num_slabs));
+		parallel_for_instance.run(num_slabs);
+	}
+	else
+		VINA_FOR(x, num_slabs)
+			aux(x);
+	VINA_FOR_IN(j, needed)
+		grids[needed[j]].compact(storage, layout);
+	if(interleave)
+		add_to_interleaved(needed);
+	return needed.size();
 }
@@ -33,29 +33,40 @@ struct rigid_mismatch : public cache_mismatch {};
 struct grid_dims_mismatch : public cache_mismatch {};
 struct energy_mismatch : public cache_mismatch {};
 
+struct lazy_population; // what the grids populated lazily are computed from
+
 struct cache : public igrid {
-	cache(const std::string& scoring_function_version_, const grid_dims& gd_, fl slope_, atom_type::t atom_typing_used_);
+	cache(const std::string& scoring_function_version_, const grid_dims& gd_, fl slope_, atom_type::t atom_typing_used_, grid_storage storage_ = grid_double,
+	      grid_layout layout_ = grid_linear, bool interleave_ = false, // interleave_: the grids of all the atom types are kept as one, with their values side by side at every grid point
+	      grid_interpolation interpolation_ = grid_trilinear, bool lazy_ = false); // lazy_: see populate
 	fl eval      (const model& m, fl v) const; // needs m.coords // clean up
 	fl eval_deriv(      model& m, fl v) const; // needs m.coords, sets m.minus_forces // clean up
-#if 0 // no longer doing I/O of the cache
-	void read(const path& name); // can throw cache_mismatch
-	void write(const path& name) const;
-#endif
-	void populate(const model& m, const precalculate& p, const szv& atom_types_needed, bool display_progress = true);
+	std::string file_name(const model& m) const; // unique to the grid atoms of m, gd, the atom typing, the scoring function version, the storage and the layout
+	void read(const path& name, const model& m); // adds the grids found there; can throw cache_mismatch, file_error
+	void write(const path& name, const model& m) const; // the grids populated so far
+	sz populate(const model& m, const precalculate& p, const szv& atom_types_needed, bool display_progress = true, sz num_threads = 1); // returns the number of grids computed; they are the same for any num_threads
+	// If lazy_, populate only sets up the grids, and each brick of grid_brick^3 points of them is computed, with the same values, by
+	// the first eval or eval_deriv that needs it; they can run concurrently, but then p must outlive the cache, and write skips those grids.
+	// Lazy grids need grid_double or grid_float, and neither grid_sparse nor interleave_.
+	bool populates_lazily() const { return lazy; }
+	bool interleaving() const { return interleave; } // then populate replaces the grids that eval and eval_deriv read
 private:
 	std::string scoring_function_version;
 	atomv atoms; // for verification
 	grid_dims gd;
-	fl slope; // does not get (de-)serialized
+	fl slope; // is not kept in grid files
 	atom_type::t atu;
-	std::vector<grid> grids;
-
-	friend class boost::serialization::access;
-	template<class Archive>
-	void save(Archive& ar, const unsigned version) const;
-	template<class Archive>
-	void load(Archive& ar, const unsigned version);
-	BOOST_SERIALIZATION_SPLIT_MEMBER()
+	grid_storage storage; // of the grids, once populated
+	grid_layout layout;
+	bool interleave;
+	grid_interpolation interpolation; // of every grid; it does not change their values, so grid files do not depend on it
+	bool lazy;
+	boost::shared_ptr<const lazy_population> lazy_from; // set by the first populate, if lazy
+	std::vector<grid> grids; // by atom type, unless interleave
+	grid interleaved; // if interleave
+	szv channels; // of each atom type in interleaved, max_sz if it has none
+	bool populated(sz t) const { return grids[t].initialized() || channels[t] < max_sz; }
+	void add_to_interleaved(const szv& types); // moves their grids into interleaved
 };
 
 #endif
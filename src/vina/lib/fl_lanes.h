@@ -0,0 +1,156 @@
+/*
+
+   Copyright (c) 2006-2010, The Scripps Research Institute
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   Author: Dr. Oleg Trott <ot14@columbia.edu>, 
+           The Olson Lab, 
+           The Scripps Research Institute
+
+*/
+
+#ifndef VINA_FL_LANES_H
+#define VINA_FL_LANES_H
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <boost/cstdint.hpp>
+#include "common.h"
+
+// Vectors of fl for the kernels of interpolate(), non_cache and the interacting pairs of model. Each has the
+// arithmetic of fl, lane by lane, so that the expressions of the scalar code they replace, evaluated in the same
+// order, give the same results.
+// The width is picked at compile time from the predefined macros: AVX-512, AVX, SSE2 or a single plain fl.
+#if defined(__AVX512F__)
+struct fl_lanes {
+	enum { width = 8 };
+	__m512d x;
+	fl_lanes(__m512d x_) : x(x_) {}
+	explicit fl_lanes(fl a) : x(_mm512_set1_pd(a)) {}
+	static fl_lanes load(const fl* p) { return fl_lanes(_mm512_loadu_pd(p)); }
+	static fl_lanes gather(const fl* p, const sz* indexes) { // p[indexes[0]], p[indexes[1]], ...; sz is 64 bits wide wherever AVX-512 is
+		return fl_lanes(_mm512_i64gather_pd(_mm512_loadu_si512(indexes), p, 8));
+	}
+	static fl_lanes gather32(const fl* p, const boost::uint32_t* indexes) { // as gather, for indexes of 32 bits, below 2^31
+		return fl_lanes(_mm512_i32gather_pd(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(indexes)), p, 8));
+	}
+	template<typename T> // fl or float
+	static fl_lanes gather(const T* const* p) { // *p[0], *p[1], ...
+		return fl_lanes(_mm512_set_pd(*p[7], *p[6], *p[5], *p[4], *p[3], *p[2], *p[1], *p[0]));
+	}
+	void store(fl* p) const { _mm512_storeu_pd(p, x); }
+};
+inline fl_lanes operator+(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(_mm512_add_pd(a.x, b.x)); }
+inline fl_lanes operator-(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(_mm512_sub_pd(a.x, b.x)); }
+inline fl_lanes operator*(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(_mm512_mul_pd(a.x, b.x)); }
+inline fl_lanes operator/(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(_mm512_div_pd(a.x, b.x)); }
+inline fl_lanes if_positive(const fl_lanes& c, const fl_lanes& a, const fl_lanes& b) { // c > 0 ? a : b
+	return fl_lanes(_mm512_mask_blend_pd(_mm512_cmp_pd_mask(c.x, _mm512_setzero_pd(), _CMP_GT_OQ), b.x, a.x));
+}
+inline fl_lanes if_zero(const fl_lanes& c, const fl_lanes& a) { // c == 0 ? a : 0
+	return fl_lanes(_mm512_maskz_mov_pd(_mm512_cmp_pd_mask(c.x, _mm512_setzero_pd(), _CMP_EQ_OQ), a.x));
+}
+inline unsigned less_mask(const fl_lanes& a, const fl_lanes& b) { // bit k is set if a < b in lane k
+	return _mm512_cmp_pd_mask(a.x, b.x, _CMP_LT_OQ);
+}
+inline fl_lanes truncate(const fl_lanes& a) { // fl(sz(a)), for 0 <= a < 2^31
+	return fl_lanes(_mm512_cvtepi32_pd(_mm512_cvttpd_epi32(a.x)));
+}
+#elif defined(__AVX__)
+struct fl_lanes {
+	enum { width = 4 };
+	__m256d x;
+	fl_lanes(__m256d x_) : x(x_) {}
+	explicit fl_lanes(fl a) : x(_mm256_set1_pd(a)) {}
+	static fl_lanes load(const fl* p) { return fl_lanes(_mm256_loadu_pd(p)); }
+#if defined(__AVX2__) && defined(__x86_64__)
+	static fl_lanes gather(const fl* p, const sz* indexes) { return fl_lanes(_mm256_i64gather_pd(p, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indexes)), 8)); }
+	static fl_lanes gather32(const fl* p, const boost::uint32_t* indexes) { return fl_lanes(_mm256_i32gather_pd(p, _mm_loadu_si128(reinterpret_cast<const __m128i*>(indexes)), 8)); }
+#else
+	static fl_lanes gather(const fl* p, const sz* indexes) { return fl_lanes(_mm256_set_pd(p[indexes[3]], p[indexes[2]], p[indexes[1]], p[indexes[0]])); }
+	static fl_lanes gather32(const fl* p, const boost::uint32_t* indexes) { return fl_lanes(_mm256_set_pd(p[indexes[3]], p[indexes[2]], p[indexes[1]], p[indexes[0]])); }
+#endif
+	template<typename T> static fl_lanes gather(const T* const* p) { return fl_lanes(_mm256_set_pd(*p[3], *p[2], *p[1], *p[0])); }
+	void store(fl* p) const { _mm256_storeu_pd(p, x); }
+};
+inline fl_lanes operator+(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(_mm256_add_pd(a.x, b.x)); }
+inline fl_lanes operator-(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(_mm256_sub_pd(a.x, b.x)); }
+inline fl_lanes operator*(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(_mm256_mul_pd(a.x, b.x)); }
+inline fl_lanes operator/(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(_mm256_div_pd(a.x, b.x)); }
+inline fl_lanes if_positive(const fl_lanes& c, const fl_lanes& a, const fl_lanes& b) {
+	return fl_lanes(_mm256_blendv_pd(b.x, a.x, _mm256_cmp_pd(c.x, _mm256_setzero_pd(), _CMP_GT_OQ)));
+}
+inline fl_lanes if_zero(const fl_lanes& c, const fl_lanes& a) {
+	return fl_lanes(_mm256_and_pd(_mm256_cmp_pd(c.x, _mm256_setzero_pd(), _CMP_EQ_OQ), a.x));
+}
+inline unsigned less_mask(const fl_lanes& a, const fl_lanes& b) {
+	return _mm256_movemask_pd(_mm256_cmp_pd(a.x, b.x, _CMP_LT_OQ));
+}
+inline fl_lanes truncate(const fl_lanes& a) {
+	return fl_lanes(_mm256_cvtepi32_pd(_mm256_cvttpd_epi32(a.x)));
+}
+#elif defined(__SSE2__)
+struct fl_lanes {
+	enum { width = 2 };
+	__m128d x;
+	fl_lanes(__m128d x_) : x(x_) {}
+	explicit fl_lanes(fl a) : x(_mm_set1_pd(a)) {}
+	static fl_lanes load(const fl* p) { return fl_lanes(_mm_loadu_pd(p)); }
+	static fl_lanes gather(const fl* p, const sz* indexes) { return fl_lanes(_mm_set_pd(p[indexes[1]], p[indexes[0]])); }
+	static fl_lanes gather32(const fl* p, const boost::uint32_t* indexes) { return fl_lanes(_mm_set_pd(p[indexes[1]], p[indexes[0]])); }
+	template<typename T> static fl_lanes gather(const T* const* p) { return fl_lanes(_mm_set_pd(*p[1], *p[0])); }
+	void store(fl* p) const { _mm_storeu_pd(p, x); }
+};
+inline fl_lanes operator+(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(_mm_add_pd(a.x, b.x)); }
+inline fl_lanes operator-(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(_mm_sub_pd(a.x, b.x)); }
+inline fl_lanes operator*(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(_mm_mul_pd(a.x, b.x)); }
+inline fl_lanes operator/(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(_mm_div_pd(a.x, b.x)); }
+inline fl_lanes if_positive(const fl_lanes& c, const fl_lanes& a, const fl_lanes& b) {
+	const __m128d mask = _mm_cmpgt_pd(c.x, _mm_setzero_pd());
+	return fl_lanes(_mm_or_pd(_mm_and_pd(mask, a.x), _mm_andnot_pd(mask, b.x)));
+}
+inline fl_lanes if_zero(const fl_lanes& c, const fl_lanes& a) {
+	return fl_lanes(_mm_and_pd(_mm_cmpeq_pd(c.x, _mm_setzero_pd()), a.x));
+}
+inline unsigned less_mask(const fl_lanes& a, const fl_lanes& b) {
+	return _mm_movemask_pd(_mm_cmplt_pd(a.x, b.x));
+}
+inline fl_lanes truncate(const fl_lanes& a) {
+	return fl_lanes(_mm_cvtepi32_pd(_mm_cvttpd_epi32(a.x)));
+}
+#else
+struct fl_lanes {
+	enum { width = 1 };
+	fl x;
+	explicit fl_lanes(fl a) : x(a) {}
+	static fl_lanes load(const fl* p) { return fl_lanes(*p); }
+	static fl_lanes gather(const fl* p, const sz* indexes) { return fl_lanes(p[indexes[0]]); }
+	static fl_lanes gather32(const fl* p, const boost::uint32_t* indexes) { return fl_lanes(p[indexes[0]]); }
+	template<typename T> static fl_lanes gather(const T* const* p) { return fl_lanes(*p[0]); }
+	void store(fl* p) const { *p = x; }
+};
+inline fl_lanes operator+(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(a.x + b.x); }
+inline fl_lanes operator-(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(a.x - b.x); }
+inline fl_lanes operator*(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(a.x * b.x); }
+inline fl_lanes operator/(const fl_lanes& a, const fl_lanes& b) { return fl_lanes(a.x / b.x); }
+inline fl_lanes if_positive(const fl_lanes& c, const fl_lanes& a, const fl_lanes& b) { return (c.x > 0) ? a : b; }
+inline fl_lanes if_zero(const fl_lanes& c, const fl_lanes& a) { return (c.x == 0) ? a : fl_lanes(0); }
+inline unsigned less_mask(const fl_lanes& a, const fl_lanes& b) { return (a.x < b.x) ? 1 : 0; }
+inline fl_lanes truncate(const fl_lanes& a) { return fl_lanes(fl(sz(a.x))); }
+#endif
+
+#endif
@@ -20,30 +20,423 @@
 
 */
 
+#include <cmath> // floor
 #include "grid.h"
+#include "fl_lanes.h"
 
-void grid::init(const grid_dims& gd) {
-	m_data.resize(gd[0].n+1, gd[1].n+1, gd[2].n+1);
+void grid::init(const grid_dims& gd, grid_storage storage, grid_layout layout, sz channels) {
+	VINA_CHECK(channels > 0);
+	m_lazy.reset();
+	m_storage = storage;
+	m_layout = layout;
+	m_channels = channels;
+	VINA_FOR(i, 3)
+		m_dim[i] = gd[i].n+1;
+	allocate();
 	m_init = vec(gd[0].begin, gd[1].begin, gd[2].begin);
 	m_range = vec(gd[0].span(), gd[1].span(), gd[2].span());
 	assert(m_range[0] > 0);
 	assert(m_range[1] > 0);
 	assert(m_range[2] > 0);
-	m_dim_fl_minus_1 = vec(m_data.dim0() - 1.0, 
-	                       m_data.dim1() - 1.0,
-			               m_data.dim2() - 1.0);
+	m_dim_fl_minus_1 = vec(dim(0) - 1.0, 
+	                       dim(1) - 1.0,
+			               dim(2) - 1.0);
 	VINA_FOR(i, 3) {
 		m_factor[i] = m_dim_fl_minus_1[i] / m_range[i];
 		m_factor_inv[i] = 1 / m_factor[i];
 	}
 }
 
-fl grid::evaluate_aux(const vec& location, fl slope, fl v, vec* deriv) const { // sets *deriv if not NULL
-	vec s  = elementwise_product(location - m_init, m_factor); 
+sz grid::values() const {
+	switch(m_storage) {
+		case grid_float: return m_data_float.size();
+		case grid_int16: return m_data_int16.size();
+		default: return m_data.size();
+	}
+}
+
+void grid::allocate() {
+	VINA_FOR(i, 3)
+		m_bricks[i] = (m_layout != grid_linear) ? (m_dim[i] + grid_brick - 1) / grid_brick : 0;
+	m_brick_shift = 0;
+	if(m_layout != grid_linear) {
+		m_stride[0] = m_channels;
+		m_stride[1] = m_stride[0] * grid_brick;
+		m_stride[2] = m_stride[1] * grid_brick;
+		m_brick_stride[0] = m_stride[2] * grid_brick;
+		if(m_layout == grid_sparse) { // so that sparse_index can split the offsets with a shift and a mask
+			while((sz(1) << m_brick_shift) < m_brick_stride[0])
+				++m_brick_shift;
+			m_brick_stride[0] = sz(1) << m_brick_shift;
+		}
+		m_brick_stride[1] = m_brick_stride[0] * m_bricks[0];
+		m_brick_stride[2] = m_brick_stride[1] * m_bricks[1];
+	}
+	else {
+		m_stride[0] = m_channels;
+		m_stride[1] = m_stride[0] * m_dim[0];
+		m_stride[2] = m_stride[1] * m_dim[1];
+		m_brick_stride.assign(0);
+	}
+	array3d<fl>().swap(m_data);
+	std::vector<float>().swap(m_data_float);
+	std::vector<boost::int16_t>().swap(m_data_int16);
+	szv().swap(m_brick_start);
+	szv().swap(m_brick_keep);
+	m_int16_offset.assign(m_channels, 0);
+	m_int16_scale .assign(m_channels, 1);
+	sz n = checked_multiply(checked_multiply(m_dim[0], m_dim[1], m_dim[2]), m_channels);
+	if(m_layout != grid_linear)
+		n = checked_multiply(checked_multiply(m_bricks[0], m_bricks[1], m_bricks[2]), brick_values());
+	if(m_layout == grid_sparse) { // one value per channel for every brick, until place_bricks is given those that need all theirs
+		place_bricks(std::vector<char>(m_bricks[0] * m_bricks[1] * m_bricks[2], 1));
+		return;
+	}
+	switch(m_storage) {
+		case grid_float: m_data_float.resize(n); break;
+		case grid_int16: m_data_int16.resize(n); break;
+		default:
+			if(m_layout == grid_linear && m_channels == 1)
+				m_data.resize(m_dim[0], m_dim[1], m_dim[2]); // as array3d<fl> indexes it
+			else
+				m_data.resize(n, 1, 1);
+	}
+}
+
+void grid::place_bricks(const std::vector<char>& constant) {
+	assert(m_layout == grid_sparse && constant.size() == m_bricks[0] * m_bricks[1] * m_bricks[2]);
+	m_brick_start.resize(constant.size());
+	m_brick_keep .resize(constant.size());
+	sz n = 0;
+	VINA_FOR_IN(b, constant) {
+		m_brick_start[b] = n;
+		m_brick_keep [b] = constant[b] ? 0 : max_sz;
+		n += constant[b] ? m_channels : brick_values();
+	}
+	switch(m_storage) {
+		case grid_float: std::vector<float>(n).swap(m_data_float); break;
+		case grid_int16: std::vector<boost::int16_t>(n).swap(m_data_int16); break;
+		default: m_data.resize(n, 1, 1);
+	}
+}
+
+void grid::set(sz i, sz channel, fl value) {
+	switch(m_storage) {
+		case grid_float: m_data_float[i + channel] = float(value); break;
+		case grid_int16: {
+			fl q = std::floor((value - m_int16_offset[channel]) / m_int16_scale[channel] + 0.5);
+			if(q < -32767) q = -32767;
+			if(q >  32767) q =  32767;
+			m_data_int16[i + channel] = boost::int16_t(q);
+			break;
+		}
+		default: m_data.data()[i + channel] = value;
+	}
+}
+
+void grid::compact(grid_storage storage, grid_layout layout) {
+	VINA_CHECK(m_storage == grid_double && m_layout == grid_linear && m_channels == 1 && !m_lazy);
+	if(storage == grid_double && layout == grid_linear) return;
+	array3d<fl> linear;
+	linear.swap(m_data); // freed on return
+	const fl* data = linear.data();
+	const sz n = linear.size();
+	m_storage = storage;
+	m_layout = layout;
+	allocate();
+	flv brick_min; // with grid_sparse
+	if(layout == grid_sparse) {
+		const sz num_bricks = m_brick_start.size();
+		brick_min.assign(num_bricks, max_fl);
+		flv brick_max(num_bricks, -max_fl);
+		sz i = 0;
+		VINA_FOR(z, m_dim[2])
+			VINA_FOR(y, m_dim[1])
+				VINA_FOR(x, m_dim[0]) {
+					const sz b = offset(x, y, z) >> m_brick_shift;
+					const fl value = data[i++];
+					if(value < brick_min[b]) brick_min[b] = value;
+					if(value > brick_max[b]) brick_max[b] = value;
+				}
+		std::vector<char> constant(num_bricks);
+		VINA_FOR(b, num_bricks)
+			constant[b] = (brick_min[b] == brick_max[b] || brick_min[b] >= grid_saturation);
+		place_bricks(constant);
+	}
+	if(storage == grid_int16) {
+		fl lo = max_fl;
+		fl hi = -max_fl;
+		VINA_FOR(i, n) {
+			if(data[i] < lo) lo = data[i];
+			if(data[i] > hi) hi = data[i];
+		}
+		m_int16_scale[0] = (hi > lo) ? (hi - lo) / 65534 : 1;
+		m_int16_offset[0] = lo + 32767 * m_int16_scale[0]; // the midpoint
+	}
+	sz i = 0;
+	VINA_FOR(z, m_dim[2])
+		VINA_FOR(y, m_dim[1])
+			VINA_FOR(x, m_dim[0]) {
+				const sz o = offset(x, y, z);
+				if(layout == grid_sparse) {
+					const sz b = o >> m_brick_shift;
+					set(sparse_index(o), 0, m_brick_keep[b] ? data[i] : brick_min[b]);
+				}
+				else
+					set(o, 0, data[i]);
+				++i;
+			}
+}
+
+template<typename T>
+void copy_channel(const T* from, sz from_channels, sz from_channel, T* to, sz to_channels, sz to_channel, sz points) {
+	VINA_FOR(i, points)
+		to[i * to_channels + to_channel] = from[i * from_channels + from_channel];
+}
+
+template<typename T>
+void copy_sparse_channel(const T* from, const szv& from_start, const szv& from_keep, sz from_channels, sz from_channel,
+                         T* to, const szv& to_start, const szv& to_keep, sz to_channels, sz to_channel) { // brick by brick; a brick of to can only share its values if that of from does
+	VINA_FOR_IN(b, to_start) {
+		const T* f = from + from_start[b] + from_channel;
+		T* t = to + to_start[b] + to_channel;
+		if(!to_keep[b])
+			t[0] = f[0];
+		else
+			VINA_FOR(i, grid_brick * grid_brick * grid_brick)
+				t[i * to_channels] = f[(i * from_channels) & from_keep[b]];
+	}
+}
+
+void grid::interleave(const std::vector<const grid*>& from, const szv& from_channels) {
+	VINA_CHECK(!from.empty() && from.size() == from_channels.size());
+	const grid& first = *from.front();
+	m_init           = first.m_init;
+	m_range          = first.m_range;
+	m_factor         = first.m_factor;
+	m_dim_fl_minus_1 = first.m_dim_fl_minus_1;
+	m_factor_inv     = first.m_factor_inv;
+	m_dim            = first.m_dim;
+	m_storage        = first.m_storage;
+	m_layout         = first.m_layout;
+	m_interpolation  = first.m_interpolation;
+	m_channels       = from.size();
+	allocate();
+	if(m_layout == grid_sparse) { // a brick shares its values if it does in every grid
+		std::vector<char> constant(m_brick_start.size(), 1);
+		VINA_FOR_IN(c, from)
+			VINA_FOR_IN(b, constant)
+				if(from[c]->m_brick_keep[b])
+					constant[b] = 0;
+		place_bricks(constant);
+	}
+	const sz points = values() / m_channels;
+	VINA_FOR_IN(c, from) {
+		const grid& g = *from[c];
+		const sz k = from_channels[c];
+		VINA_CHECK(&g != this && g.m_dim == m_dim && g.m_storage == m_storage && g.m_layout == m_layout && k < g.m_channels && !g.m_lazy);
+		m_int16_offset[c] = g.m_int16_offset[k];
+		m_int16_scale [c] = g.m_int16_scale [k];
+		if(m_layout == grid_sparse) {
+			switch(m_storage) {
+				case grid_float: copy_sparse_channel(&g.m_data_float[0], g.m_brick_start, g.m_brick_keep, g.m_channels, k, &m_data_float[0], m_brick_start, m_brick_keep, m_channels, c); break;
+				case grid_int16: copy_sparse_channel(&g.m_data_int16[0], g.m_brick_start, g.m_brick_keep, g.m_channels, k, &m_data_int16[0], m_brick_start, m_brick_keep, m_channels, c); break;
+				default:         copy_sparse_channel(g.m_data.data(),    g.m_brick_start, g.m_brick_keep, g.m_channels, k, m_data.data(),     m_brick_start, m_brick_keep, m_channels, c);
+			}
+			continue;
+		}
+		switch(m_storage) {
+			case grid_float: copy_channel(&g.m_data_float[0], g.m_channels, k, &m_data_float[0], m_channels, c, points); break;
+			case grid_int16: copy_channel(&g.m_data_int16[0], g.m_channels, k, &m_data_int16[0], m_channels, c, points); break;
+			default:         copy_channel(g.m_data.data(),    g.m_channels, k, m_data.data(),     m_channels, c, points);
+		}
+	}
+}
+
+void grid::swap(grid& other) {
+	VINA_CHECK(!m_lazy && !other.m_lazy); // they are filled where they are
+	std::swap(m_init,           other.m_init);
+	std::swap(m_range,          other.m_range);
+	std::swap(m_factor,         other.m_factor);
+	std::swap(m_dim_fl_minus_1, other.m_dim_fl_minus_1);
+	std::swap(m_factor_inv,     other.m_factor_inv);
+	std::swap(m_dim,            other.m_dim);
+	std::swap(m_bricks,         other.m_bricks);
+	std::swap(m_stride,         other.m_stride);
+	std::swap(m_brick_stride,   other.m_brick_stride);
+	std::swap(m_brick_shift,    other.m_brick_shift);
+	m_brick_start .swap(other.m_brick_start);
+	m_brick_keep  .swap(other.m_brick_keep);
+	std::swap(m_storage,        other.m_storage);
+	std::swap(m_layout,         other.m_layout);
+	std::swap(m_interpolation,  other.m_interpolation);
+	std::swap(m_channels,       other.m_channels);
+	m_data_float  .swap(other.m_data_float);
+	m_data_int16  .swap(other.m_data_int16);
+	m_int16_offset.swap(other.m_int16_offset);
+	m_int16_scale .swap(other.m_int16_scale);
+	m_data        .swap(other.m_data);
+}
+
+struct lazy_bricks {
+	boost::shared_ptr<const grid_filler> filler;
+	std::vector<grid*> grids;
+	boost::array<sz, 3> bricks; // along each axis
+	std::vector<boost::once_flag> filled; // for each brick
+};
+
+void grid::fill_lazily(const std::vector<grid*>& grids, const boost::shared_ptr<const grid_filler>& filler) {
+	VINA_CHECK(!grids.empty());
+	const grid& first = *grids.front();
+	boost::shared_ptr<lazy_bricks> lazy(new lazy_bricks);
+	lazy->filler = filler;
+	lazy->grids = grids;
+	VINA_FOR(i, 3)
+		lazy->bricks[i] = (first.m_dim[i] + grid_brick - 1) / grid_brick;
+	const boost::once_flag not_filled = BOOST_ONCE_INIT;
+	lazy->filled.assign(lazy->bricks[0] * lazy->bricks[1] * lazy->bricks[2], not_filled);
+	VINA_FOR_IN(i, grids) {
+		grid& g = *grids[i];
+		VINA_CHECK(g.initialized() && g.m_dim == first.m_dim && g.m_storage != grid_int16 && g.m_layout != grid_sparse && g.m_channels == 1); // the values are set one by one, where they are
+		g.m_lazy = lazy;
+	}
+}
+
+struct brick_filling { // for boost::call_once
+	const lazy_bricks* lazy;
+	sz bx, by, bz;
+	brick_filling(const lazy_bricks* lazy_, sz bx_, sz by_, sz bz_) : lazy(lazy_), bx(bx_), by(by_), bz(bz_) {}
+	void operator()() const { // the values of lazy grids are set by const evaluations, each once, before any is read
+		const std::vector<grid*>& grids = lazy->grids;
+		const grid& first = *grids.front();
+		flv values(grids.size());
+		for(sz z = bz * grid_brick; z < (std::min)((bz + 1) * grid_brick, first.m_dim[2]); ++z)
+			for(sz y = by * grid_brick; y < (std::min)((by + 1) * grid_brick, first.m_dim[1]); ++y)
+				for(sz x = bx * grid_brick; x < (std::min)((bx + 1) * grid_brick, first.m_dim[0]); ++x) {
+					(*lazy->filler)(first.index_to_argument(x, y, z), &values[0]);
+					VINA_FOR_IN(i, grids)
+						grids[i]->set(grids[i]->offset(x, y, z), 0, values[i]);
+				}
+	}
+};
+
+void grid::fill_around(const boost::array<sz, 3>& a) const {
+	boost::array<sz, 3> lo, hi; // the bricks of the points that can be interpolated from in cell a
+	VINA_FOR(i, 3) {
+		const sz reach = (m_interpolation == grid_tricubic) ? 1 : 0;
+		lo[i] = ((a[i] > reach) ? a[i] - reach : 0) / grid_brick;
+		hi[i] = (std::min)(a[i] + 1 + reach, m_dim[i] - 1) / grid_brick;
+	}
+	lazy_bricks& lazy = *m_lazy;
+	for(sz bz = lo[2]; bz <= hi[2]; ++bz)
+		for(sz by = lo[1]; by <= hi[1]; ++by)
+			for(sz bx = lo[0]; bx <= hi[0]; ++bx)
+				boost::call_once(lazy.filled[bx + lazy.bricks[0] * (by + lazy.bricks[1] * bz)], brick_filling(&lazy, bx, by, bz));
+}
+
+template<typename T>
+void unscaled_values(const T* a, const sz* o, sz n, fl* f) {
+	VINA_FOR(i, n)
+		f[i] = a[o[i]];
+}
+
+void grid::fetch(const sz* o, sz n, sz channel, fl* f) const {
+	sz sparse_o[64];
+	if(m_layout == grid_sparse) {
+		assert(n <= 64);
+		VINA_FOR(i, n)
+			sparse_o[i] = sparse_index(o[i]);
+		o = sparse_o;
+	}
+	switch(m_storage) {
+		case grid_float: unscaled_values(&m_data_float[0] + channel, o, n, f); break;
+		case grid_int16:
+			unscaled_values(&m_data_int16[0] + channel, o, n, f);
+			VINA_FOR(i, n)
+				f[i] = m_int16_offset[channel] + m_int16_scale[channel] * f[i];
+			break;
+		default: unscaled_values(m_data.data() + channel, o, n, f);
+	}
+}
+
+void grid::corners(sz x0, sz y0, sz z0, sz channel, fl* f) const {
+	const sz ox0 = axis_offset(0, x0);
+	const sz ox1 = axis_offset(0, x0+1);
+	const sz oy0 = axis_offset(1, y0);
+	const sz oy1 = axis_offset(1, y0+1);
+	const sz oz0 = axis_offset(2, z0);
+	const sz oz1 = axis_offset(2, z0+1);
+	sz o[8];
+	o[0] = ox0 + oy0 + oz0;
+	o[1] = ox1 + oy0 + oz0;
+	o[2] = ox0 + oy1 + oz0;
+	o[3] = ox1 + oy1 + oz0;
+	o[4] = ox0 + oy0 + oz1;
+	o[5] = ox1 + oy0 + oz1;
+	o[6] = ox0 + oy1 + oz1;
+	o[7] = ox1 + oy1 + oz1;
+	fetch(o, 8, channel, f);
+}
+
+void catmull_rom(fl t, fl* w, fl* dw) { // the weights of the points at -1, 0, 1 and 2 for t in 0 .. 1, and their derivatives
+	const fl t2 = t * t;
+	const fl t3 = t2 * t;
+	w[0] = 0.5 * (    -t3 + 2 * t2 - t);
+	w[1] = 0.5 * ( 3 * t3 - 5 * t2 + 2);
+	w[2] = 0.5 * (-3 * t3 + 4 * t2 + t);
+	w[3] = 0.5 * (     t3 -     t2    );
+	dw[0] = 0.5 * (-3 * t2 +  4 * t - 1);
+	dw[1] = 0.5 * ( 9 * t2 - 10 * t    );
+	dw[2] = 0.5 * (-9 * t2 +  8 * t + 1);
+	dw[3] = 0.5 * ( 3 * t2 -  2 * t    );
+}
+
+fl grid::tricubic(const boost::array<sz, 3>& a, const vec& s, sz channel, vec* gradient) const { // the gradient costs little more, so it is always computed
+	fl w[3][4];
+	fl dw[3][4];
+	sz oa[3][4]; // offsets of the points along each axis
+	VINA_FOR(i, 3) {
+		catmull_rom(s[i], w[i], dw[i]);
+		VINA_FOR(k, 4) {
+			sz p = a[i] + k;
+			if(p < 1) p = 1; // a[i] - 1 would be before the first point
+			else if(p > dim(i)) p = dim(i);
+			oa[i][k] = axis_offset(i, p - 1);
+		}
+	}
+	sz o[64];
+	VINA_FOR(z, 4)
+		VINA_FOR(y, 4)
+			VINA_FOR(x, 4)
+				o[x + 4 * (y + 4 * z)] = oa[0][x] + oa[1][y] + oa[2][z];
+	fl points[64];
+	fetch(o, 64, channel, points);
+	fl f = 0;
+	vec g(0, 0, 0);
+	VINA_FOR(z, 4) { // the splines are separable: along x, then y, then z
+		fl plane = 0, plane_x = 0, plane_y = 0;
+		VINA_FOR(y, 4) {
+			const fl* p = points + 4 * (y + 4 * z);
+			const fl row   =  w[0][0] * p[0] +  w[0][1] * p[1] +  w[0][2] * p[2] +  w[0][3] * p[3];
+			const fl row_x = dw[0][0] * p[0] + dw[0][1] * p[1] + dw[0][2] * p[2] + dw[0][3] * p[3];
+			plane   +=  w[1][y] * row;
+			plane_x +=  w[1][y] * row_x;
+			plane_y += dw[1][y] * row;
+		}
+		f    +=  w[2][z] * plane;
+		g[0] +=  w[2][z] * plane_x;
+		g[1] +=  w[2][z] * plane_y;
+		g[2] += dw[2][z] * plane;
+	}
+	if(gradient)
+		*gradient = g;
+	return f;
+}
+
+fl grid::locate(const vec& location, fl slope, boost::array<sz, 3>& a, vec& s, boost::array<int, 3>& region) const {
+	s  = elementwise_product(location - m_init, m_factor); 
 
 	vec miss(0, 0, 0);
-	boost::array<int, 3> region;
-	boost::array<sz, 3> a;
 
 	VINA_FOR(i, 3) {
 		if(s[i] < 0) {
@@ -55,8 +448,8 @@ fl grid::evaluate_aux(const vec& location, fl slope, fl v, vec* deriv) const { /
 		else if(s[i] >= m_dim_fl_minus_1[i]) {
 			miss[i] = s[i] - m_dim_fl_minus_1[i];
 			region[i] = 1;
-			assert(m_data.dim(i) >= 2);
-			a[i] = m_data.dim(i) -  2; 
+			assert(dim(i) >= 2);
+			a[i] = dim(i) -  2; 
 			s[i] = 1;
 		}
 		else {
@@ -67,28 +460,45 @@ fl grid::evaluate_aux(const vec& location, fl slope, fl v, vec* deriv) const { /
 		assert(s[i] >= 0);
 		assert(s[i] <= 1);
 		assert(a[i] >= 0);
-		assert(a[i]+1 < m_data.dim(i));
+		assert(a[i]+1 < dim(i));
 	}
 	const fl penalty = slope * (miss * m_factor_inv); // FIXME check that inv_factor is correctly initialized and serialized
 	assert(penalty > -epsilon_fl);
+	return penalty;
+}
 
-	const sz x0 = a[0];
-	const sz y0 = a[1];
-	const sz z0 = a[2];
+fl grid::evaluate_aux(const vec& location, fl slope, fl v, vec* deriv, sz channel) const { // sets *deriv if not NULL
+	vec s;
+	boost::array<int, 3> region;
+	boost::array<sz, 3> a;
+	const fl penalty = locate(location, slope, a, s, region);
+	ensure_filled(a);
 
-	const sz x1 = x0+1;
-	const sz y1 = y0+1;
-	const sz z1 = z0+1;
+	if(m_interpolation == grid_tricubic) {
+		if(!deriv) {
+			fl f = tricubic(a, s, channel, NULL);
+			curl(f, v);
+			return f + penalty;
+		}
+		vec gradient;
+		fl f = tricubic(a, s, channel, &gradient);
+		curl(f, gradient, v);
+		VINA_FOR(i, 3)
+			(*deriv)[i] = m_factor[i] * ((region[i] == 0) ? gradient[i] : 0) + slope * region[i];
+		return f + penalty;
+	}
 
+	fl corner_values[8];
+	corners(a[0], a[1], a[2], channel, corner_values);
 
-	const fl f000 = m_data(x0, y0, z0);
-	const fl f100 = m_data(x1, y0, z0);
-	const fl f010 = m_data(x0, y1, z0);
-	const fl f110 = m_data(x1, y1, z0);
-	const fl f001 = m_data(x0, y0, z1);
-	const fl f101 = m_data(x1, y0, z1);
-	const fl f011 = m_data(x0, y1, z1);
-	const fl f111 = m_data(x1, y1, z1);
+	const fl f000 = corner_values[0];
+	const fl f100 = corner_values[1];
+	const fl f010 = corner_values[2];
+	const fl f110 = corner_values[3];
+	const fl f001 = corner_values[4];
+	const fl f101 = corner_values[5];
+	const fl f011 = corner_values[6];
+	const fl f111 = corner_values[7];
 
 	const fl x = s[0];
 	const fl y = s[1];
@@ -157,3 +567,114 @@ fl grid::evaluate_aux(const vec& location, fl slope, fl v, vec* deriv) const { /
 		return f + penalty;
 	}
 } 
+
+grid_batch::grid_batch() : size(0) { // the lanes past size are interpolated too, so they should hold numbers
+	std::fill(&corner[0][0], &corner[0][0] + 8 * grid_lanes, 0.0);
+	std::fill(&frac  [0][0], &frac  [0][0] + 3 * grid_lanes, 0.0);
+	std::fill(&factor[0][0], &factor[0][0] + 3 * grid_lanes, 0.0);
+	std::fill(&region[0][0], &region[0][0] + 3 * grid_lanes, 0.0);
+	std::fill(penalty, penalty + grid_lanes, 0.0);
+}
+
+void grid::gather(const vec& location, fl slope, grid_batch& b, sz channel) const {
+	assert(b.size < grid_lanes);
+	assert(m_interpolation == grid_trilinear);
+	const sz k = b.size;
+	vec s;
+	boost::array<int, 3> region;
+	boost::array<sz, 3> a;
+	b.penalty[k] = locate(location, slope, a, s, region);
+	ensure_filled(a);
+	fl corner_values[8];
+	corners(a[0], a[1], a[2], channel, corner_values);
+	VINA_FOR(i, 8)
+		b.corner[i][k] = corner_values[i];
+	VINA_FOR(i, 3) {
+		b.frac[i][k] = s[i];
+		b.factor[i][k] = m_factor[i];
+		b.region[i][k] = region[i];
+	}
+	++b.size;
+}
+
+void interpolate(const grid_batch& b, fl slope, fl v, fl* e, vec* deriv) {
+	const fl_lanes one(1);
+	const fl_lanes minus_one(-1);
+	const fl_lanes slope_lanes(slope);
+	const bool curled = not_max(v);
+	const fl_lanes v_lanes(v);
+	for(sz i = 0; i < b.size; i += fl_lanes::width) {
+		const fl_lanes f000 = fl_lanes::load(&b.corner[0][i]);
+		const fl_lanes f100 = fl_lanes::load(&b.corner[1][i]);
+		const fl_lanes f010 = fl_lanes::load(&b.corner[2][i]);
+		const fl_lanes f110 = fl_lanes::load(&b.corner[3][i]);
+		const fl_lanes f001 = fl_lanes::load(&b.corner[4][i]);
+		const fl_lanes f101 = fl_lanes::load(&b.corner[5][i]);
+		const fl_lanes f011 = fl_lanes::load(&b.corner[6][i]);
+		const fl_lanes f111 = fl_lanes::load(&b.corner[7][i]);
+
+		const fl_lanes x = fl_lanes::load(&b.frac[0][i]);
+		const fl_lanes y = fl_lanes::load(&b.frac[1][i]);
+		const fl_lanes z = fl_lanes::load(&b.frac[2][i]);
+
+		const fl_lanes mx = one - x;
+		const fl_lanes my = one - y;
+		const fl_lanes mz = one - z;
+
+		fl_lanes f = 
+			f000 *  mx * my * mz  +
+			f100 *   x * my * mz  +
+			f010 *  mx *  y * mz  + 
+			f110 *   x *  y * mz  +
+			f001 *  mx * my *  z  +
+			f101 *   x * my *  z  +
+			f011 *  mx *  y *  z  +
+			f111 *   x *  y *  z  ;
+
+		fl_lanes gradient[3] = {
+			f000 * minus_one * my * mz  +
+			f100 *       one * my * mz  +
+			f010 * minus_one *  y * mz  + 
+			f110 *       one *  y * mz  +
+			f001 * minus_one * my *  z  +
+			f101 *       one * my *  z  +
+			f011 * minus_one *  y *  z  +
+			f111 *       one *  y *  z  ,
+
+			f000 *  mx * minus_one * mz  +
+			f100 *   x * minus_one * mz  +
+			f010 *  mx *       one * mz  + 
+			f110 *   x *       one * mz  +
+			f001 *  mx * minus_one *  z  +
+			f101 *   x * minus_one *  z  +
+			f011 *  mx *       one *  z  +
+			f111 *   x *       one *  z  ,
+
+			f000 *  mx * my * minus_one  +
+			f100 *   x * my * minus_one  +
+			f010 *  mx *  y * minus_one  + 
+			f110 *   x *  y * minus_one  +
+			f001 *  mx * my *       one  +
+			f101 *   x * my *       one  +
+			f011 *  mx *  y *       one  +
+			f111 *   x *  y *       one
+		};
+
+		if(curled) { // curl(), with a factor of 1 where f is not positive
+			const fl_lanes tmp = if_positive(f, (v < epsilon_fl) ? fl_lanes(0) : v_lanes / (v_lanes + f), one);
+			f = f * tmp;
+			const fl_lanes tmp_sqr = tmp * tmp;
+			VINA_FOR(j, 3)
+				gradient[j] = gradient[j] * tmp_sqr;
+		}
+
+		(f + fl_lanes::load(&b.penalty[i])).store(&e[i]);
+		fl d[3][fl_lanes::width];
+		VINA_FOR(j, 3) {
+			const fl_lanes region = fl_lanes::load(&b.region[j][i]);
+			(fl_lanes::load(&b.factor[j][i]) * if_zero(region, gradient[j]) + slope_lanes * region).store(d[j]);
+		}
+		VINA_FOR(k, fl_lanes::width)
+			deriv[i + k] = vec(d[0][k], d[1][k], d[2][k]);
+	}
+}
@@ -23,43 +23,146 @@
 #ifndef VINA_GRID_H
 #define VINA_GRID_H
 
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/once.hpp>
 #include "array3d.h"
 #include "grid_dim.h"
 #include "curl.h"
 
+// How the values of a grid are kept once computed. Against grid_double, an interpolated value is off by at most
+// 2^-24 times the largest magnitude in the grid with grid_float, and by at most (max - min) / 131068 with grid_int16,
+// which scales the values of each grid linearly onto -32767 .. 32767. For the XS grids, whose
+// values stay within about -1.5 .. 35 kcal/mol, that is under 0.0003 kcal/mol per atom.
+enum grid_storage { grid_double, grid_float, grid_int16 };
+
+// How the grid points are ordered in memory. grid_linear is the array3d order. grid_blocked keeps the points
+// in bricks of grid_brick^3, one brick after the other, so that the 8 corners around a location mostly lie in
+// the same cache lines, and so do those of the atoms nearby. grid_sparse orders them as grid_blocked, but a
+// brick whose values are all the same, such as one out of reach of the receptor, where they are all 0, or all
+// at least grid_saturation, deep inside the receptor, keeps a single value per channel: the smallest.
+// Elsewhere the energies are those of grid_blocked; in a saturated brick, they stay at least
+// grid_saturation, with no gradient.
+enum grid_layout { grid_linear, grid_blocked, grid_sparse };
+
+const sz grid_brick = 4; // points along each edge of a brick of grid_blocked and grid_sparse
+
+const fl grid_saturation = 10; // kcal/mol, per atom; no pose worth keeping has an atom there
+
+// How a grid is evaluated between its points. grid_trilinear blends the 8 corners of the cell; its error grows
+// with the square of the spacing. grid_tricubic fits Catmull-Rom splines through the 4x4x4 points around the
+// cell, with the gradient taken from the same splines; its error grows with the cube of the spacing, so it
+// can keep the accuracy of trilinear interpolation on a grid that is coarser, and 4-8 times smaller. Points
+// past the edges of the grid are taken as those on the edges. Both use the same stored values.
+enum grid_interpolation { grid_trilinear, grid_tricubic };
+
+const sz grid_lanes = 8; // locations interpolated together by interpolate()
+
+struct grid_batch { // locations gathered by grid::gather, in structure-of-arrays form for interpolate()
+	fl corner[8][grid_lanes]; // f000, f100, f010, f110, f001, f101, f011, f111
+	fl frac[3][grid_lanes]; // within the cell, 0 .. 1
+	fl factor[3][grid_lanes]; // of the grid each location was gathered from
+	fl region[3][grid_lanes]; // -1, 0 or 1, for below, within or above the grid along each axis
+	fl penalty[grid_lanes]; // for being outside the grid
+	sz size;
+	grid_batch();
+};
+
+// Sets e[i] and deriv[i] to what grid::evaluate gives for each location gathered in b, bit for bit. e and
+// deriv need room for grid_lanes. The lanes are AVX-512, AVX or SSE2 vectors of doubles, whichever the
+// compiler targets, or plain doubles otherwise.
+void interpolate(const grid_batch& b, fl slope, fl v, fl* e, vec* deriv);
+
+struct grid_filler { // computes the values of lazy grids as they are first needed, from several threads at once
+	virtual void operator()(const vec& location, fl* values) const = 0; // one for each grid, in the order given to grid::fill_lazily
+	virtual ~grid_filler() {}
+};
+
+struct lazy_bricks; // of the grids filled together
+
 class grid { // FIXME rm 'm_', consistent with my new style
     vec m_init;
     vec m_range;
     vec m_factor;
     vec m_dim_fl_minus_1;
 	vec m_factor_inv;
+	boost::array<sz, 3> m_dim; // grid points along each axis
+	boost::array<sz, 3> m_bricks; // along each axis, with grid_blocked
+	boost::array<sz, 3> m_stride; // between neighboring points along each axis, within a brick with grid_blocked
+	boost::array<sz, 3> m_brick_stride; // between neighboring bricks, with grid_blocked; with grid_sparse, m_brick_stride[0] is 1 << m_brick_shift
+	sz m_brick_shift; // with grid_sparse, offset() gives the brick << m_brick_shift | the offset within the brick
+	szv m_brick_start; // with grid_sparse, where the values of each brick start
+	szv m_brick_keep; // with grid_sparse, the mask of the offsets within each brick: all ones, or 0 if its points share one value per channel
+	grid_storage m_storage;
+	grid_layout m_layout;
+	grid_interpolation m_interpolation;
+	sz m_channels; // values per grid point, next to each other; an interleaved grid has one per atom type
+	std::vector<float> m_data_float;
+	std::vector<boost::int16_t> m_data_int16;
+	flv m_int16_offset; // per channel; value = m_int16_offset + m_int16_scale * stored
+	flv m_int16_scale;
+	boost::shared_ptr<lazy_bricks> m_lazy; // if set, the values of each brick are only computed when first needed
+	friend struct cache; // reads and writes the compacted values
+	friend struct brick_filling;
 public:
-	array3d<fl> m_data; // FIXME? - make cache a friend, and convert this back to private?
-	grid() : m_init(0, 0, 0), m_range(1, 1, 1), m_factor(1, 1, 1), m_dim_fl_minus_1(-1, -1, -1), m_factor_inv(1, 1, 1) {} // not private
-	grid(const grid_dims& gd) { init(gd); }
-    void init(const grid_dims& gd);
+	array3d<fl> m_data; // FIXME? - convert this back to private? // filled in array3d order; with grid_double in other layouts or channels, compact() and interleave() keep the values there, flat
+	grid() : m_init(0, 0, 0), m_range(1, 1, 1), m_factor(1, 1, 1), m_dim_fl_minus_1(-1, -1, -1), m_factor_inv(1, 1, 1), m_storage(grid_double), m_layout(grid_linear), m_interpolation(grid_trilinear), m_channels(1), m_int16_offset(1, 0), m_int16_scale(1, 1) {
+		m_dim.assign(0);
+		m_bricks.assign(0);
+		m_stride.assign(0);
+		m_brick_stride.assign(0);
+		m_brick_shift = 0;
+	} // not private
+	grid(const grid_dims& gd) : m_interpolation(grid_trilinear) { init(gd); }
+    void init(const grid_dims& gd, grid_storage storage = grid_double, grid_layout layout = grid_linear, sz channels = 1); // the values are allocated, but not set; with grid_sparse, only one per brick and channel
+	void compact(grid_storage storage, grid_layout layout = grid_linear); // converts m_data to storage and layout, freeing it
+	void interleave(const std::vector<const grid*>& from, const szv& from_channels); // one channel per grid given, copied from its channel in from_channels; they must share their points, storage and layout, and not include *this
+	void swap(grid& other);
+	// Instead of setting their values, has the filler compute those of each brick of grid_brick^3 points, for all the grids at once, when one
+	// of them first needs it. The grids need the same points, grid_double or grid_float, one channel, and not grid_sparse; they can then
+	// be evaluated concurrently, but must stay where they are.
+	static void fill_lazily(const std::vector<grid*>& grids, const boost::shared_ptr<const grid_filler>& filler);
+	bool lazy() const { return bool(m_lazy); }
+	void set_interpolation(grid_interpolation interpolation) { m_interpolation = interpolation; } // kept by init, compact and interleave
+	grid_interpolation interpolation() const { return m_interpolation; }
+	grid_storage storage() const { return m_storage; }
+	grid_layout layout() const { return m_layout; }
+	sz channels() const { return m_channels; }
 	vec index_to_argument(sz x, sz y, sz z) const {
 		return vec(m_init[0] + m_factor_inv[0] * x,
 		           m_init[1] + m_factor_inv[1] * y,
 		           m_init[2] + m_factor_inv[2] * z);
 	}
+	sz dim(sz i) const { return m_dim[i]; }
 	bool initialized() const {
-		return m_data.dim0() > 0 && m_data.dim1() > 0 && m_data.dim2() > 0;
+		return dim(0) > 0 && dim(1) > 0 && dim(2) > 0;
 	}
-	fl evaluate(const vec& location, fl slope, fl c)             const { return evaluate_aux(location, slope, c, NULL);   }
-	fl evaluate(const vec& location, fl slope, fl c, vec& deriv) const { return evaluate_aux(location, slope, c, &deriv); } // sets deriv
+	fl evaluate(const vec& location, fl slope, fl c,             sz channel = 0) const { return evaluate_aux(location, slope, c, NULL,   channel); }
+	fl evaluate(const vec& location, fl slope, fl c, vec& deriv, sz channel = 0) const { return evaluate_aux(location, slope, c, &deriv, channel); } // sets deriv
+	void gather(const vec& location, fl slope, grid_batch& b, sz channel = 0) const; // adds location to b, which must not be full; grid_trilinear only
 private:
-	fl evaluate_aux(const vec& location, fl slope, fl v, vec* deriv) const; // sets *deriv if not NULL
-	friend class boost::serialization::access;
-	template<class Archive>
-	void serialize(Archive& ar, const unsigned version) {
-		ar & m_init;
-		ar & m_data;
-		ar & m_range;
-		ar & m_factor;
-		ar & m_dim_fl_minus_1;
-		ar & m_factor_inv;
+	fl locate(const vec& location, fl slope, boost::array<sz, 3>& a, vec& s, boost::array<int, 3>& region) const; // the cell of location, where it is within, and its region along each axis; returns the penalty
+	void ensure_filled(const boost::array<sz, 3>& a) const { if(m_lazy) fill_around(a); } // the points interpolated in cell a
+	void fill_around(const boost::array<sz, 3>& a) const;
+	fl evaluate_aux(const vec& location, fl slope, fl v, vec* deriv, sz channel) const; // sets *deriv if not NULL
+	fl tricubic(const boost::array<sz, 3>& a, const vec& s, sz channel, vec* gradient) const; // the value at s within cell a, and if not NULL, its gradient in grid units
+	void allocate(); // the values of m_dim points in m_storage and m_layout, m_channels each
+	sz values() const; // how many are allocated, including the unused ones of partial bricks
+	sz brick_values() const { return grid_brick * grid_brick * grid_brick * m_channels; }
+	void place_bricks(const std::vector<char>& constant); // with grid_sparse, lays out the bricks, one after the other, and allocates their values, which are not set
+	sz sparse_index(sz o) const { // of the values, from the offset() of a point with grid_sparse
+		const sz b = o >> m_brick_shift;
+		return m_brick_start[b] + (o & (m_brick_stride[0] - 1) & m_brick_keep[b]);
+	}
+	sz axis_offset(sz i, sz a) const { // the offsets of the points are the sums of those along the three axes
+		if(m_layout != grid_linear)
+			return m_brick_stride[i] * (a / grid_brick) + m_stride[i] * (a % grid_brick);
+		return m_stride[i] * a;
 	}
+	sz offset(sz x, sz y, sz z) const { return axis_offset(0, x) + axis_offset(1, y) + axis_offset(2, z); } // of the first channel of a point, among the values
+	void set(sz i, sz channel, fl value); // i is the index of a point among the values: its offset, but with grid_sparse
+	void corners(sz x0, sz y0, sz z0, sz channel, fl* f) const; // the 8 values around, f000, f100, f010, f110, f001, f101, f011, f111
+	void fetch(const sz* o, sz n, sz channel, fl* f) const; // the values of the n points at offsets o, n <= 64
 };
 
 #endif
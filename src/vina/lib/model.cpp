@@ -23,6 +23,7 @@
 #include "model.h"
 #include "file.h"
 #include "curl.h"
+#include "fl_lanes.h"
 
 template<typename T>
 atom_range get_atom_range(const T& t) {
@@ -232,6 +233,7 @@ void model::append(const model& m) {
 	t.coords_append(     atoms, m     .atoms);
 
 	m_num_movable_atoms += m.m_num_movable_atoms;
+	pack_pairs();
 }
 
 ///////////////////  end  MODEL::APPEND /////////////////////////
@@ -466,12 +468,29 @@ void model::initialize_pairs(const distance_type_matrix& mobility) {
 	}
 }
 
+packed_pairs::packed_pairs(const interacting_pairs& pairs) {
+	VINA_FOR_IN(i, pairs) {
+		const interacting_pair& ip = pairs[i];
+		VINA_CHECK(ip.type_pair_index < 0x80000000 && 3 * ip.a < 0x80000000 && 3 * ip.b < 0x80000000); // gathered as signed 32 bit indexes
+		type_pair_index.push_back(boost::uint32_t(ip.type_pair_index));
+		a.push_back(boost::uint32_t(3 * ip.a));
+		b.push_back(boost::uint32_t(3 * ip.b));
+	}
+}
+
+void model::pack_pairs() {
+	VINA_FOR_IN(i, ligands)
+		ligands[i].packed = packed_pairs(ligands[i].pairs);
+	other_packed = packed_pairs(other_pairs);
+}
+
 void model::initialize(const distance_type_matrix& mobility) {
 	VINA_FOR_IN(i, ligands)
 		ligands[i].set_range();
 	assign_bonds(mobility);
 	assign_types();
 	initialize_pairs(mobility);
+	pack_pairs();
 }
 
 ///////////////////  end  MODEL::INITIALIZE /////////////////////////
@@ -496,6 +515,22 @@ szv model::get_movable_atom_types(atom_type::t atom_typing_used_) const {
 	return tmp;
 }
 
+szv model::get_atom_types(atom_type::t atom_typing_used_) const {
+	szv tmp;
+	sz n = num_atom_types(atom_typing_used_);
+	VINA_FOR_IN(i, grid_atoms) {
+		sz t = grid_atoms[i].get(atom_typing_used_);
+		if(t < n && !has(tmp, t))
+			tmp.push_back(t);
+	}
+	VINA_FOR_IN(i, atoms) {
+		sz t = atoms[i].get(atom_typing_used_);
+		if(t < n && !has(tmp, t))
+			tmp.push_back(t);
+	}
+	return tmp;
+}
+
 conf_size model::get_size() const {
 	conf_size tmp;
 	tmp.ligands = ligands.count_torsions();
@@ -614,26 +649,107 @@ fl eval_interacting_pairs(const precalculate& p, fl v, const interacting_pairs&
 	return e;
 }
 
-fl eval_interacting_pairs_deriv(const precalculate& p, fl v, const interacting_pairs& pairs, const vecv& coords, vecv& forces) { // adds to forces  // clean up
+// The kernel of eval_interacting_pairs_deriv, as that of non_cache::eval_deriv: the pairs are taken pair_block
+// at a time, those within the cutoff are picked out without branching, and their table entries are gathered
+// and interpolated in lanes. The energies and forces are added up in the order of the pairs, so the results
+// are those of the scalar loop, bit for bit.
+const sz pair_block = 256; // a multiple of every fl_lanes::width
+
+template<typename T> // of the table entries: fl, or float with a compact precalculate
+fl eval_packed_pairs_deriv(const precalculate& p, fl v, const packed_pairs& pairs, const vecv& coords, vecv& forces) { // adds to forces
 	const fl cutoff_sqr = p.cutoff_sqr();
+	const fl_lanes cutoff_sqr_lanes(cutoff_sqr);
+	const fl_lanes factor(p.element(0).factor); // the same for every type pair
+	const bool curled = not_max(v);
+	const fl_lanes curl_v(v);
+	const fl* c = coords[0].data; // x, y, z of every atom in turn
+	fl* f = forces[0].data;
 	fl e = 0;
-	VINA_FOR_IN(i, pairs) {
-		const interacting_pair& ip = pairs[i];
-		vec r; r = coords[ip.b] - coords[ip.a]; // a -> b
-		fl r2 = sqr(r);
-		if(r2 < cutoff_sqr) {
-			pr tmp = p.eval_deriv(ip.type_pair_index, r2);
-			vec force; force = tmp.second * r;
-			curl(tmp.first, force, v);
-			e += tmp.first;
-			// FIXME inefficient, if using hard curl
-			forces[ip.a] -= force; // we could omit forces on inflex here
-			forces[ip.b] += force;
+	boost::uint32_t hit_a[pair_block + fl_lanes::width]; // with room for a last, partial set of lanes
+	boost::uint32_t hit_b[pair_block + fl_lanes::width];
+	boost::uint32_t hit_type[pair_block + fl_lanes::width];
+	for(sz begin = 0; begin < pairs.size(); begin += pair_block) {
+		const sz end = (std::min)(begin + pair_block, pairs.size());
+		sz num_hits = 0;
+		sz i = begin;
+		for(; i + fl_lanes::width <= end; i += fl_lanes::width) {
+			const boost::uint32_t* a = &pairs.a[i];
+			const boost::uint32_t* b = &pairs.b[i];
+			const fl_lanes rx = fl_lanes::gather32(c,     b) - fl_lanes::gather32(c,     a);
+			const fl_lanes ry = fl_lanes::gather32(c + 1, b) - fl_lanes::gather32(c + 1, a);
+			const fl_lanes rz = fl_lanes::gather32(c + 2, b) - fl_lanes::gather32(c + 2, a);
+			const unsigned within = less_mask(rx * rx + ry * ry + rz * rz, cutoff_sqr_lanes);
+			VINA_FOR(l, fl_lanes::width) { // every pair is written, but only the hits are kept
+				hit_a[num_hits] = a[l];
+				hit_b[num_hits] = b[l];
+				hit_type[num_hits] = pairs.type_pair_index[i + l];
+				num_hits += (within >> l) & 1;
+			}
+		}
+		for(; i < end; ++i) {
+			const boost::uint32_t a = pairs.a[i];
+			const boost::uint32_t b = pairs.b[i];
+			const vec r(c[b] - c[a], c[b + 1] - c[a + 1], c[b + 2] - c[a + 2]);
+			hit_a[num_hits] = a;
+			hit_b[num_hits] = b;
+			hit_type[num_hits] = pairs.type_pair_index[i];
+			num_hits += (sqr(r) < cutoff_sqr) ? 1 : 0;
+		}
+		if(num_hits == 0) continue;
+
+		VINA_FOR(l, fl_lanes::width) { // the lanes past the hits repeat the first, and are not added up
+			hit_a[num_hits + l] = hit_a[0];
+			hit_b[num_hits + l] = hit_b[0];
+			hit_type[num_hits + l] = hit_type[0];
+		}
+		for(sz h = 0; h < num_hits; h += fl_lanes::width) {
+			const boost::uint32_t* a = hit_a + h;
+			const boost::uint32_t* b = hit_b + h;
+			const fl_lanes rx = fl_lanes::gather32(c,     b) - fl_lanes::gather32(c,     a); // a -> b
+			const fl_lanes ry = fl_lanes::gather32(c + 1, b) - fl_lanes::gather32(c + 1, a);
+			const fl_lanes rz = fl_lanes::gather32(c + 2, b) - fl_lanes::gather32(c + 2, a);
+			const fl_lanes r2_factored = factor * (rx * rx + ry * ry + rz * rz); // as precalculate_element::eval_deriv and eval_deriv_compact
+			fl_lanes pair_e(0);
+			fl_lanes dor(0);
+			eval_deriv_lanes<T>(p, hit_type + h, r2_factored, pair_e, dor);
+			fl_lanes fx = dor * rx;
+			fl_lanes fy = dor * ry;
+			fl_lanes fz = dor * rz;
+			if(curled) { // as curl(), in the lanes of positive energies
+				const fl_lanes tmp = (v < epsilon_fl) ? fl_lanes(0) : curl_v / (curl_v + pair_e);
+				const fl_lanes tmp_sqr = tmp * tmp;
+				fx = if_positive(pair_e, fx * tmp_sqr, fx);
+				fy = if_positive(pair_e, fy * tmp_sqr, fy);
+				fz = if_positive(pair_e, fz * tmp_sqr, fz);
+				pair_e = if_positive(pair_e, pair_e * tmp, pair_e);
+			}
+			fl pair_e_lanes[fl_lanes::width];
+			fl force[3][fl_lanes::width];
+			pair_e.store(pair_e_lanes);
+			fx.store(force[0]);
+			fy.store(force[1]);
+			fz.store(force[2]);
+			const sz lanes = (std::min)(sz(fl_lanes::width), num_hits - h);
+			VINA_FOR(l, lanes) {
+				e += pair_e_lanes[l];
+				VINA_FOR(d, 3) {
+					f[a[l] + d] -= force[d][l]; // we could omit forces on inflex here
+					f[b[l] + d] += force[d][l];
+				}
+			}
 		}
 	}
 	return e;
 }
 
+fl eval_interacting_pairs_deriv(const precalculate& p, fl v, const packed_pairs& pairs, const vecv& coords, vecv& forces) { // adds to forces
+	if(pairs.size() == 0)
+		return 0;
+	if(p.compact())
+		return eval_packed_pairs_deriv<float>(p, v, pairs, coords, forces);
+	return eval_packed_pairs_deriv<fl>(p, v, pairs, coords, forces);
+}
+
 fl model::evali(const precalculate& p,                                  const vec& v                          ) const { // clean up
 	fl e = 0;
 	VINA_FOR_IN(i, ligands) 
@@ -658,9 +774,9 @@ fl model::eval         (const precalculate& p, const igrid& ig, const vec& v, co
 fl model::eval_deriv  (const precalculate& p, const igrid& ig, const vec& v, const conf& c, change& g) { // clean up
 	set(c);
 	fl e = ig.eval_deriv(*this, v[1]); // sets minus_forces, except inflex
-	e += eval_interacting_pairs_deriv(p, v[2], other_pairs, coords, minus_forces); // adds to minus_forces
+	e += eval_interacting_pairs_deriv(p, v[2], other_packed, coords, minus_forces); // adds to minus_forces
 	VINA_FOR_IN(i, ligands)
-		e += eval_interacting_pairs_deriv(p, v[0], ligands[i].pairs, coords, minus_forces); // adds to minus_forces
+		e += eval_interacting_pairs_deriv(p, v[0], ligands[i].packed, coords, minus_forces); // adds to minus_forces
 	// calculate derivatives
 	ligands.derivative(coords, minus_forces, g.ligands);
 	flex   .derivative(coords, minus_forces, g.flex); // inflex forces are ignored
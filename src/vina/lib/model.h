@@ -24,6 +24,7 @@
 #define VINA_MODEL_H
 
 #include <boost/optional.hpp> // for context
+#include <boost/cstdint.hpp> // for packed_pairs
 
 #include "file.h"
 #include "tree.h"
@@ -41,12 +42,22 @@ struct interacting_pair {
 
 typedef std::vector<interacting_pair> interacting_pairs;
 
+struct packed_pairs { // interacting_pairs side by side, in the same order, for the kernel of their derivatives
+	std::vector<boost::uint32_t> type_pair_index;
+	std::vector<boost::uint32_t> a; // 3 * the coords index, that of its x in the fl of a vecv
+	std::vector<boost::uint32_t> b; // likewise
+	packed_pairs() {}
+	explicit packed_pairs(const interacting_pairs& pairs);
+	sz size() const { return a.size(); }
+};
+
 typedef std::pair<std::string, boost::optional<sz> > parsed_line;
 typedef std::vector<parsed_line> context;
 
 struct ligand : public flexible_body, atom_range {
 	unsigned degrees_of_freedom; // can be different from the apparent number of rotatable bonds, because of the disabled torsions
 	interacting_pairs pairs;
+	packed_pairs packed; // of pairs, set by model
 	context cont;
 	ligand(const flexible_body& f, unsigned degrees_of_freedom_) : flexible_body(f), atom_range(0, 0), degrees_of_freedom(degrees_of_freedom_) {}
 	void set_range();
@@ -82,6 +93,7 @@ struct model {
 	sz ligand_length(sz ligand_number) const;
 
 	szv get_movable_atom_types(atom_type::t atom_typing_used_) const;
+	szv get_atom_types(atom_type::t atom_typing_used_) const; // of all the atoms, grid atoms included
 
 	conf_size get_size() const;
 	conf get_initial_conf() const; // torsions = 0, orientations = identity, ligand positions = current
@@ -171,6 +183,7 @@ private:
 	friend struct non_cache;
 	friend struct naive_non_cache;
 	friend struct cache;
+	friend struct boxed_igrid;
 	friend struct szv_grid;
 	friend struct terms;
 	friend struct conf_independent_inputs;
@@ -208,6 +221,7 @@ private:
 	void assign_types();
 	void initialize_pairs(const distance_type_matrix& mobility);
 	void initialize(const distance_type_matrix& mobility);
+	void pack_pairs();
 	fl clash_penalty_aux(const interacting_pairs& pairs) const;
 
 	vecv internal_coords;
@@ -220,6 +234,7 @@ private:
 	vector_mutable<residue> flex;
 	context flex_context;
 	interacting_pairs other_pairs; // all except internal to one ligand: ligand-other ligands; ligand-flex/inflex; flex-flex/inflex
+	packed_pairs other_packed; // of other_pairs
 
 	sz m_num_movable_atoms;
 	atom_type::t m_atom_typing_used;
@@ -79,14 +79,14 @@ output_type monte_carlo::many_runs(model& m, const precalculate& p, const igrid&
 
 
 // out is sorted
-void monte_carlo::operator()(model& m, output_container& out, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const vec& corner1, const vec& corner2, incrementable* increment_me, rng& generator) const {
+void monte_carlo::operator()(model& m, output_container& out, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const vec& corner1, const vec& corner2, incrementable* increment_me, rng& generator, bfgs_counters* counters) const {
 	vec authentic_v(1000, 1000, 1000); // FIXME? this is here to avoid max_fl/max_fl
 	conf_size s = m.get_size();
 	change g(s);
 	output_type tmp(s, 0);
 	tmp.c.randomize(corner1, corner2, generator);
 	fl best_e = max_fl;
-	quasi_newton quasi_newton_par; quasi_newton_par.max_steps = ssd_par.evals;
+	quasi_newton quasi_newton_par; quasi_newton_par.max_steps = ssd_par.evals; quasi_newton_par.counters = counters;
 	VINA_U_FOR(step, num_steps) {
 		if(increment_me)
 			++(*increment_me);
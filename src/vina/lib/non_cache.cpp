@@ -22,8 +22,85 @@
 
 #include "non_cache.h"
 #include "curl.h"
+#include "fl_lanes.h"
+
+// The kernel of eval_deriv. The neighbors of an atom are taken neighbor_block at a time. Their distances are
+// computed fl_lanes::width at a time, and those within the cutoff are picked out without branching, as the
+// hits are too irregular for branches to predict. The table entries of the hits are then gathered and
+// interpolated in lanes too, and added up in the order of the neighbor list, so the results are those of the
+// scalar loop, bit for bit.
+const sz neighbor_block = 256; // a multiple of every fl_lanes::width
+
+template<typename T> // of the table entries: fl, or float with a compact precalculate
+void add_neighbors(const vec& coords, const szv_grid_atoms& atoms, const precalculate& p, sz n, sz t1, fl& e, vec& deriv) {
+	const fl_lanes x(coords[0]);
+	const fl_lanes y(coords[1]);
+	const fl_lanes z(coords[2]);
+	const fl_lanes factor(p.element(0).factor); // the same for every type pair
+	const fl cutoff_sqr = p.cutoff_sqr();
+	const fl_lanes cutoff_sqr_lanes(cutoff_sqr);
+	sz hits[neighbor_block + fl_lanes::width]; // with room for a last, partial set of lanes
+	for(const sz* block = atoms.begin; block != atoms.end; ) {
+		const sz count = (std::min)(sz(atoms.end - block), neighbor_block);
+		sz num_hits = 0;
+		sz k = 0;
+		for(; k + fl_lanes::width <= count; k += fl_lanes::width) {
+			const sz* indexes = block + k;
+			const fl_lanes rx = x - fl_lanes::gather(atoms.x, indexes);
+			const fl_lanes ry = y - fl_lanes::gather(atoms.y, indexes);
+			const fl_lanes rz = z - fl_lanes::gather(atoms.z, indexes);
+			const unsigned within = less_mask(rx * rx + ry * ry + rz * rz, cutoff_sqr_lanes);
+			VINA_FOR(l, fl_lanes::width) { // every neighbor is written, but only the hits are kept
+				hits[num_hits] = indexes[l];
+				num_hits += (within >> l) & 1;
+			}
+		}
+		for(; k < count; ++k) {
+			const sz i = block[k];
+			const vec r_ba(coords[0] - atoms.x[i], coords[1] - atoms.y[i], coords[2] - atoms.z[i]);
+			hits[num_hits] = i;
+			num_hits += (sqr(r_ba) < cutoff_sqr) ? 1 : 0;
+		}
+		block += count;
+		if(num_hits == 0) continue;
+
+		VINA_FOR(l, fl_lanes::width) // the lanes past the hits repeat the first, and are not added up
+			hits[num_hits + l] = hits[0];
+		for(sz h = 0; h < num_hits; h += fl_lanes::width) {
+			const sz* indexes = hits + h;
+			const fl_lanes rx = x - fl_lanes::gather(atoms.x, indexes); // the same sign as r_ba, so that the derivatives match those of the scalar loop
+			const fl_lanes ry = y - fl_lanes::gather(atoms.y, indexes);
+			const fl_lanes rz = z - fl_lanes::gather(atoms.z, indexes);
+			const fl_lanes r2_factored = factor * (rx * rx + ry * ry + rz * rz); // as precalculate_element::eval_deriv and eval_deriv_compact
+			sz type_pairs[fl_lanes::width];
+			VINA_FOR(l, fl_lanes::width)
+				type_pairs[l] = triangular_matrix_index_permissive(n, t1, atoms.type[indexes[l]]);
+			fl_lanes e_lanes(0);
+			fl_lanes dor(0);
+			eval_deriv_lanes<T>(p, type_pairs, r2_factored, e_lanes, dor);
+			fl pair_e[fl_lanes::width];
+			fl d[3][fl_lanes::width];
+			e_lanes.store(pair_e);
+			(dor * rx).store(d[0]);
+			(dor * ry).store(d[1]);
+			(dor * rz).store(d[2]);
+			const sz lanes = (std::min)(sz(fl_lanes::width), num_hits - h);
+			VINA_FOR(l, lanes) {
+				e += pair_e[l];
+				deriv += vec(d[0][l], d[1][l], d[2][l]);
+			}
+		}
+	}
+}
 
-non_cache::non_cache(const model& m, const grid_dims& gd_, const precalculate* p_, fl slope_) : sgrid(m, szv_grid_dims(gd_), p_->cutoff_sqr()), gd(gd_), p(p_), slope(slope_) {}
+non_cache::non_cache(const model& m, const grid_dims& gd_, const precalculate* p_, fl slope_) : sgrid(m, szv_grid_dims(gd_), p_->cutoff_sqr()), gd(gd_), p(p_), slope(slope_) {
+	VINA_CHECK(m.atom_typing_used() == p->atom_typing_used()); // sgrid holds the receptor types in the typing of m
+}
+
+non_cache::non_cache(const non_cache& other, const precalculate* p_) : slope(other.slope), sgrid(other.sgrid), gd(other.gd), p(p_) {
+	VINA_CHECK(p->atom_typing_used() == other.p->atom_typing_used());
+	VINA_CHECK(p->cutoff_sqr() == other.p->cutoff_sqr()); // sgrid only keeps the atoms within the cutoff
+}
 
 fl non_cache::eval      (const model& m, fl v) const { // clean up
 	fl e = 0;
@@ -47,17 +124,15 @@ fl non_cache::eval      (const model& m, fl v) const { // clean up
 		}
 		out_of_bounds_penalty *= slope;
 
-		const szv& possibilities = sgrid.possibilities(adjusted_a_coords);
+		const szv_grid_atoms possibilities = sgrid.possibilities(adjusted_a_coords);
 
-		VINA_FOR_IN(possibilities_j, possibilities) {
-			const sz j = possibilities[possibilities_j];
-			const atom& b = m.grid_atoms[j];
-			sz t2 = b.get(p->atom_typing_used());
-			if(t2 >= n) continue;
-			vec r_ba; r_ba = adjusted_a_coords - b.coords; // FIXME why b-a and not a-b ?
+		for(const sz* k = possibilities.begin; k != possibilities.end; ++k) {
+			const sz j = *k;
+			const sz t2 = possibilities.type[j];
+			vec r_ba(adjusted_a_coords[0] - possibilities.x[j], adjusted_a_coords[1] - possibilities.y[j], adjusted_a_coords[2] - possibilities.z[j]); // FIXME why b-a and not a-b ?
 			fl r2 = sqr(r_ba);
 			if(r2 < cutoff_sqr) {
-				sz type_pair_index = get_type_pair_index(p->atom_typing_used(), a, b);
+				sz type_pair_index = triangular_matrix_index_permissive(n, t1, t2);
 				this_e +=  p->eval_fast(type_pair_index, r2);
 			}
 		}
@@ -81,7 +156,6 @@ bool non_cache::within(const model& m, fl margin) const {
 
 fl non_cache::eval_deriv(      model& m, fl v) const { // clean up
 	fl e = 0;
-	const fl cutoff_sqr = p->cutoff_sqr();
 
 	sz n = num_atom_types(p->atom_typing_used());
 
@@ -104,22 +178,12 @@ fl non_cache::eval_deriv(      model& m, fl v) const { // clean up
 		out_of_bounds_penalty *= slope;
 		out_of_bounds_deriv *= slope;
 
-		const szv& possibilities = sgrid.possibilities(adjusted_a_coords);
+		const szv_grid_atoms possibilities = sgrid.possibilities(adjusted_a_coords);
 
-		VINA_FOR_IN(possibilities_j, possibilities) {
-			const sz j = possibilities[possibilities_j];
-			const atom& b = m.grid_atoms[j];
-			sz t2 = b.get(p->atom_typing_used());
-			if(t2 >= n) continue;
-			vec r_ba; r_ba = adjusted_a_coords - b.coords; // FIXME why b-a and not a-b ?
-			fl r2 = sqr(r_ba);
-			if(r2 < cutoff_sqr) {
-				sz type_pair_index = get_type_pair_index(p->atom_typing_used(), a, b);
-				pr e_dor =  p->eval_deriv(type_pair_index, r2);
-				this_e += e_dor.first;
-				deriv += e_dor.second * r_ba;
-			}
-		}
+		if(p->compact())
+			add_neighbors<float>(adjusted_a_coords, possibilities, *p, n, t1, this_e, deriv);
+		else
+			add_neighbors<fl>   (adjusted_a_coords, possibilities, *p, n, t1, this_e, deriv);
 		curl(this_e, deriv, v);
 		m.minus_forces[i] = deriv + out_of_bounds_deriv;
 		e += this_e + out_of_bounds_penalty;
@@ -28,6 +28,7 @@
 
 struct non_cache : public igrid {
 	non_cache(const model& m, const grid_dims& gd_, const precalculate* p_, fl slope_);
+	non_cache(const non_cache& other, const precalculate* p_); // the neighbors of other, scored with p_, of the same cutoff and atom typing
 	virtual fl eval      (const model& m, fl v) const; // needs m.coords // clean up
 	virtual fl eval_deriv(      model& m, fl v) const; // needs m.coords, sets m.minus_forces // clean up
 	bool within(const model& m, fl margin = 0.0001) const;
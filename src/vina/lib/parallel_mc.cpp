@@ -29,24 +29,63 @@ struct parallel_mc_task {
 	model m;
 	output_container out;
 	rng generator;
-	parallel_mc_task(const model& m_, int seed) : m(m_), generator(static_cast<rng::result_type>(seed)) {}
+	incrementable* counter; // this task's own, can be NULL
+	bfgs_counters counters;
+	sz box; // where its search starts
+	parallel_mc_task(const model& m_, int seed, sz box_) : m(m_), generator(static_cast<rng::result_type>(seed)), counter(NULL), box(box_) {}
 };
 
 typedef boost::ptr_vector<parallel_mc_task> parallel_mc_task_container;
 
+struct boxed_igrid : public igrid { // the energies of ig, with the penalty of the search box
+	const igrid* ig;
+	const search_box* box;
+	boxed_igrid(const igrid* ig_, const search_box* box_) : ig(ig_), box(box_) {}
+	fl eval      (const model& m, fl v) const {
+		return ig->eval(m, v) + penalty(m, NULL);
+	}
+	fl eval_deriv(      model& m, fl v) const {
+		const fl e = ig->eval_deriv(m, v);
+		return e + penalty(m, &m.minus_forces);
+	}
+private:
+	fl penalty(const model& m, vecv* minus_forces) const { // adds its derivatives to *minus_forces, if not NULL
+		fl e = 0;
+		VINA_FOR(i, m.num_movable_atoms()) {
+			const vec& c = m.coords[i];
+			VINA_FOR(j, 3) {
+				if(c[j] < box->corner1[j]) {
+					e += box->slope * (box->corner1[j] - c[j]);
+					if(minus_forces) (*minus_forces)[i][j] -= box->slope;
+				}
+				else if(c[j] > box->corner2[j]) {
+					e += box->slope * (c[j] - box->corner2[j]);
+					if(minus_forces) (*minus_forces)[i][j] += box->slope;
+				}
+			}
+		}
+		return e;
+	}
+};
+
 struct parallel_mc_aux {
 	const monte_carlo* mc;
 	const precalculate* p;
 	const igrid* ig;
 	const precalculate* p_widened;
 	const igrid* ig_widened;
-	const vec* corner1;
-	const vec* corner2;
-	parallel_progress* pg;
-	parallel_mc_aux(const monte_carlo* mc_, const precalculate* p_, const igrid* ig_, const precalculate* p_widened_, const igrid* ig_widened_, const vec* corner1_, const vec* corner2_, parallel_progress* pg_)
-		: mc(mc_), p(p_), ig(ig_), p_widened(p_widened_), ig_widened(ig_widened_), corner1(corner1_), corner2(corner2_), pg(pg_) {}
+	const search_boxes* boxes;
+	parallel_mc_aux(const monte_carlo* mc_, const precalculate* p_, const igrid* ig_, const precalculate* p_widened_, const igrid* ig_widened_, const search_boxes* boxes_)
+		: mc(mc_), p(p_), ig(ig_), p_widened(p_widened_), ig_widened(ig_widened_), boxes(boxes_) {}
 	void operator()(parallel_mc_task& t) const {
-		(*mc)(t.m, t.out, *p, *ig, *p_widened, *ig_widened, *corner1, *corner2, pg, t.generator);
+		const search_box& b = (*boxes)[t.box];
+		if(b.slope > 0) {
+			const boxed_igrid boxed(ig, &b);
+			const boxed_igrid boxed_widened(ig_widened, &b);
+			(*mc)(t.m, t.out, *p, boxed, *p_widened, boxed_widened, b.corner1, b.corner2, t.counter, t.generator, &t.counters);
+		}
+		else
+			(*mc)(t.m, t.out, *p, *ig, *p_widened, *ig_widened, b.corner1, b.corner2, t.counter, t.generator, &t.counters);
 	}
 };
 
@@ -55,22 +94,39 @@ void merge_output_containers(const output_container& in, output_container& out,
 		add_to_output_container(out, in[i], min_rmsd, max_size);
 }
 
-void merge_output_containers(const parallel_mc_task_container& many, output_container& out, fl min_rmsd, sz max_size) {
+void merge_output_containers(const parallel_mc_task_container& many, std::vector<output_container>& outs, fl min_rmsd, sz max_size) { // into the container of the box of each task
 	min_rmsd = 2; // FIXME? perhaps it's necessary to separate min_rmsd during search and during output?
 	VINA_FOR_IN(i, many)
-		merge_output_containers(many[i].out, out, min_rmsd, max_size);
-	out.sort();
+		merge_output_containers(many[i].out, outs[many[i].box], min_rmsd, max_size);
+	VINA_FOR_IN(i, outs)
+		outs[i].sort();
 }
 
 void parallel_mc::operator()(const model& m, output_container& out, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const vec& corner1, const vec& corner2, rng& generator) const {
+	std::vector<output_container> outs;
+	this->operator()(m, outs, p, ig, p_widened, ig_widened, search_boxes(1, search_box(corner1, corner2)), generator);
+	out.swap(outs.front());
+}
+
+void parallel_mc::operator()(const model& m, std::vector<output_container>& outs, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const search_boxes& boxes, rng& generator) const {
+	VINA_CHECK(!boxes.empty());
 	parallel_progress pp;
-	parallel_mc_aux parallel_mc_aux_instance(&mc, &p, &ig, &p_widened, &ig_widened, &corner1, &corner2, (display_progress ? (&pp) : NULL));
+	parallel_mc_aux parallel_mc_aux_instance(&mc, &p, &ig, &p_widened, &ig_widened, &boxes);
 	parallel_mc_task_container task_container;
-	VINA_FOR(i, num_tasks)
-		task_container.push_back(new parallel_mc_task(m, random_int(0, 1000000, generator)));
-	if(display_progress) 
-		pp.init(num_tasks * mc.num_steps);
+	VINA_FOR_IN(b, boxes)
+		VINA_FOR(i, num_tasks)
+			task_container.push_back(new parallel_mc_task(m, random_int(0, 1000000, generator), b));
+	if(display_progress || monitor) {
+		pp.init(task_container.size(), task_container.size() * mc.num_steps, display_progress, monitor);
+		VINA_FOR_IN(i, task_container)
+			task_container[i].counter = pp.counter(i);
+	}
 	parallel_iter<parallel_mc_aux, parallel_mc_task_container, parallel_mc_task, true> parallel_iter_instance(&parallel_mc_aux_instance, num_threads);
 	parallel_iter_instance.run(task_container);
-	merge_output_containers(task_container, out, mc.min_rmsd, mc.num_saved_mins);
+	if(counters)
+		VINA_FOR_IN(i, task_container)
+			counters->add(task_container[i].counters);
+	outs.clear();
+	outs.resize(boxes.size());
+	merge_output_containers(task_container, outs, mc.min_rmsd, mc.num_saved_mins);
 }
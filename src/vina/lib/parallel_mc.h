@@ -25,13 +25,29 @@
 
 #include "monte_carlo.h"
 
+struct progress_monitor;
+
+struct search_box { // where the ligands of a search start
+	vec corner1;
+	vec corner2;
+	fl slope; // of the penalty keeping the movable atoms within, added to the energies of the grids, as out of them; 0 leaves that to the grids
+	search_box(const vec& corner1_, const vec& corner2_, fl slope_ = 0) : corner1(corner1_), corner2(corner2_), slope(slope_) {}
+};
+typedef std::vector<search_box> search_boxes;
+
+void merge_output_containers(const output_container& in, output_container& out, fl min_rmsd, sz max_size); // adds the modes of in that are not within min_rmsd of better ones
+
 struct parallel_mc {
 	monte_carlo mc;
 	sz num_tasks;
 	sz num_threads;
 	bool display_progress;
-	parallel_mc() : num_tasks(8), num_threads(1), display_progress(true) {}
+	progress_monitor* monitor; // if not NULL, kept up to date with the steps done
+	bfgs_counters* counters; // if not NULL, the work of all the tasks is added up there
+	parallel_mc() : num_tasks(8), num_threads(1), display_progress(true), monitor(NULL), counters(NULL) {}
 	void operator()(const model& m, output_container& out, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const vec& corner1, const vec& corner2, rng& generator) const;
+	// num_tasks for each of boxes, all run by the same num_threads; the modes found from each box are merged into its own element of outs
+	void operator()(const model& m, std::vector<output_container>& outs, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const search_boxes& boxes, rng& generator) const;
 };
 
 #endif
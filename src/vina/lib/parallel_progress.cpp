@@ -22,6 +22,46 @@
 
 #include "parallel_progress.h"
 
-//#include <boost/thread/condition.hpp> // FIXME do we need this?
+void parallel_progress::init(sz num_counters, unsigned long n, bool display, progress_monitor* monitor_) {
+	VINA_FOR(i, num_counters)
+		counters.push_back(new progress_counter);
+	total = n;
+	monitor = monitor_;
+	if(display)
+		p = new boost::progress_display(n);
+	if(p || monitor)
+		reporter.create_thread(aux(this));
+}
 
-// FIXME rm
\ No newline at end of file
+void parallel_progress::report() {
+	unsigned long done = 0;
+	VINA_FOR_IN(i, counters)
+		done += counters[i].value();
+	if(p && done > reported) {
+		(*p) += done - reported;
+		reported = done;
+	}
+	if(monitor)
+		monitor->set(done, total);
+}
+
+void parallel_progress::loop() {
+	boost::mutex::scoped_lock self_lk(self);
+	while(true) {
+		if(!destructing)
+			cond.timed_wait(self_lk, boost::posix_time::milliseconds(100));
+		report();
+		if(destructing)
+			break;
+	}
+}
+
+parallel_progress::~parallel_progress() {
+	{
+		boost::mutex::scoped_lock self_lk(self);
+		destructing = true;
+		cond.notify_all();
+	}
+	reporter.join_all(); // the last report is done on the way out
+	delete p;
+}
@@ -24,24 +24,66 @@
 #define VINA_PARALLEL_PROGRESS_H
 
 #include <boost/progress.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/smart_ptr/detail/atomic_count.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
 
+#include "common.h"
 #include "incrementable.h"
 
-struct parallel_progress : public incrementable {
-	parallel_progress() : p(NULL) {}
-	void init(unsigned long n) { p = new boost::progress_display(n); }
-	void operator++() {
-		if(p) {
-			boost::mutex::scoped_lock self_lk(self);
-			++(*p);
-		}
+struct progress_monitor { // the progress of a search, for other threads to poll
+	progress_monitor() : done(0), total(0) {}
+	void set(unsigned long done_, unsigned long total_) {
+		boost::mutex::scoped_lock self_lk(self);
+		done = done_;
+		total = total_;
+	}
+	void get(unsigned long& done_, unsigned long& total_) {
+		boost::mutex::scoped_lock self_lk(self);
+		done_ = done;
+		total_ = total;
 	}
-	virtual ~parallel_progress() { delete p; }
 private:
 	boost::mutex self;
-	boost::progress_display* p;
+	unsigned long done;
+	unsigned long total;
 };
 
-#endif
+struct progress_counter : public incrementable { // incremented by one thread, read by the reporter
+	progress_counter() : count(0) {}
+	void operator++() { ++count; }
+	unsigned long value() const { return static_cast<unsigned long>(static_cast<long>(count)); }
+private:
+	boost::detail::atomic_count count;
+	char padding[64]; // keeps the counters of different threads off each other's cache lines
+};
 
+// the steps are counted without locking, one counter per task, and summed up
+// by a reporter thread a few times a second
+struct parallel_progress {
+	parallel_progress() : p(NULL), monitor(NULL), total(0), reported(0), destructing(false) {}
+	void init(sz num_counters, unsigned long n, bool display, progress_monitor* monitor_);
+	incrementable* counter(sz i) { return (i < counters.size()) ? &counters[i] : NULL; }
+	virtual ~parallel_progress();
+private:
+	void loop();
+	void report();
+	struct aux {
+		parallel_progress* pg;
+		aux(parallel_progress* pg_) : pg(pg_) {}
+		void operator()() const { pg->loop(); }
+	};
+	boost::ptr_vector<progress_counter> counters;
+	boost::progress_display* p; // only touched by the reporter, or after it is done
+	progress_monitor* monitor;
+	unsigned long total;
+	unsigned long reported; // to p
+	boost::mutex self;
+	boost::condition cond;
+	bool destructing;
+	boost::thread_group reporter;
+};
+
+#endif
@@ -255,8 +255,7 @@ void parse_two_unsigneds(const std::string& str, const std::string& start, unsig
 	second = unsigned(tmp2);
 }
 
-void parse_pdbqt_rigid(const path& name, rigid& r) {
-	ifile in(name);
+void parse_pdbqt_rigid(std::istream& in, const path& name, rigid& r) { // name is only used in error messages
 	unsigned count = 0;
 	std::string str;
 	while(std::getline(in, str)) {
@@ -468,8 +467,7 @@ void postprocess_residue(non_rigid_parsed& nr, parsing_struct& p, context& c) {
 	VINA_CHECK(nr.atoms_inflex_bonds.dim_2() == nr.inflex.size());
 }
 
-void parse_pdbqt_ligand(const path& name, non_rigid_parsed& nr, context& c) {
-	ifile in(name);
+void parse_pdbqt_ligand(std::istream& in, const path& name, non_rigid_parsed& nr, context& c) { // name is only used in error messages
 	unsigned count = 0;
 	parsing_struct p;
 	boost::optional<unsigned> torsdof;
@@ -492,8 +490,7 @@ void parse_pdbqt_residue(std::istream& in, unsigned& count, parsing_struct& p, c
 	parse_pdbqt_aux(in, count, p, c, dummy, true);
 }
 
-void parse_pdbqt_flex(const path& name, non_rigid_parsed& nr, context& c) {
-	ifile in(name);
+void parse_pdbqt_flex(std::istream& in, const path& name, non_rigid_parsed& nr, context& c) { // name is only used in error messages
 	unsigned count = 0;
 	std::string str;
 
@@ -615,10 +612,10 @@ struct pdbqt_initializer {
 	}
 };
 
-model parse_ligand_pdbqt  (const path& name) { // can throw parse_error
+model parse_ligand_pdbqt(std::istream& in, const path& name) { // can throw parse_error
 	non_rigid_parsed nrp;
 	context c;
-	parse_pdbqt_ligand(name, nrp, c);
+	parse_pdbqt_ligand(in, name, nrp, c);
 
 	pdbqt_initializer tmp;
 	tmp.initialize_from_nrp(nrp, c, true);
@@ -626,12 +623,12 @@ model parse_ligand_pdbqt  (const path& name) { // can throw parse_error
 	return tmp.m;
 }
 
-model parse_receptor_pdbqt(const path& rigid_name, const path& flex_name) { // can throw parse_error
+model parse_receptor_pdbqt(std::istream& rigid_in, const path& rigid_name, std::istream& flex_in, const path& flex_name) { // can throw parse_error
 	rigid r;
 	non_rigid_parsed nrp;
 	context c;
-	parse_pdbqt_rigid(rigid_name, r);
-	parse_pdbqt_flex(flex_name, nrp, c);
+	parse_pdbqt_rigid(rigid_in, rigid_name, r);
+	parse_pdbqt_flex(flex_in, flex_name, nrp, c);
 
 	pdbqt_initializer tmp;
 	tmp.initialize_from_rigid(r);
@@ -640,9 +637,9 @@ model parse_receptor_pdbqt(const path& rigid_name, const path& flex_name) { // c
 	return tmp.m;
 }
 
-model parse_receptor_pdbqt(const path& rigid_name) { // can throw parse_error
+model parse_receptor_pdbqt(std::istream& rigid_in, const path& rigid_name) { // can throw parse_error
 	rigid r;
-	parse_pdbqt_rigid(rigid_name, r);
+	parse_pdbqt_rigid(rigid_in, rigid_name, r);
 
 	pdbqt_initializer tmp;
 	tmp.initialize_from_rigid(r);
@@ -650,3 +647,19 @@ model parse_receptor_pdbqt(const path& rigid_name) { // can throw parse_error
 	tmp.initialize(mobility_matrix);
 	return tmp.m;
 }
+
+model parse_ligand_pdbqt  (const path& name) { // can throw parse_error
+	ifile in(name);
+	return parse_ligand_pdbqt(in, name);
+}
+
+model parse_receptor_pdbqt(const path& rigid_name, const path& flex_name) { // can throw parse_error
+	ifile rigid_in(rigid_name);
+	ifile flex_in(flex_name);
+	return parse_receptor_pdbqt(rigid_in, rigid_name, flex_in, flex_name);
+}
+
+model parse_receptor_pdbqt(const path& rigid_name) { // can throw parse_error
+	ifile in(rigid_name);
+	return parse_receptor_pdbqt(in, rigid_name);
+}
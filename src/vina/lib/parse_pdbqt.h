@@ -29,4 +29,9 @@ model parse_receptor_pdbqt(const path& rigid, const path& flex); // can throw pa
 model parse_receptor_pdbqt(const path& rigid); // can throw parse_error
 model parse_ligand_pdbqt  (const path& name); // can throw parse_error
 
+// the same, reading PDBQT text from a stream; the names only show up in parse_error
+model parse_receptor_pdbqt(std::istream& rigid_in, const path& rigid_name, std::istream& flex_in, const path& flex_name); // can throw parse_error
+model parse_receptor_pdbqt(std::istream& rigid_in, const path& rigid_name); // can throw parse_error
+model parse_ligand_pdbqt  (std::istream& in, const path& name); // can throw parse_error
+
 #endif
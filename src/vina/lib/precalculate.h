@@ -25,6 +25,7 @@
 
 #include "scoring_function.h"
 #include "matrix.h"
+#include "fl_lanes.h"
 
 struct precalculate_element {
 	precalculate_element(sz n, fl factor_) : fast(n, 0), smooth(n, pr(0, 0)), factor(factor_) {}
@@ -50,6 +51,38 @@ struct precalculate_element {
 		fl dor = p1.second + rem * (p2.second - p1.second); 
 		return pr(e, dor);
 	}
+	pr eval_deriv_compact(fl r2) const { // as eval_deriv, from the compact table
+		fl r2_factored = factor * r2;
+		assert(r2_factored + 1 < smooth.size());
+		sz i1 = sz(r2_factored);
+		fl rem = r2_factored - i1;
+		const float* p = &compact[2 * i1]; // e and dor at i1, then at i1 + 1: 16 bytes, within one cache line but for 1 i1 in 8
+		fl e   = fl(p[0]) + rem * (fl(p[2]) - fl(p[0])); // in fl, as the kernels that gather them
+		fl dor = fl(p[1]) + rem * (fl(p[3]) - fl(p[1]));
+		return pr(e, dor);
+	}
+	// the table entries of eval_deriv around factor * r2 = i, and those of eval_deriv_compact, for kernels that gather them
+	void table_entries(sz i, const fl*& e1, const fl*& dor1, const fl*& e2, const fl*& dor2) const {
+		assert(i + 1 < smooth.size());
+		e1   = &smooth[i    ].first;
+		dor1 = &smooth[i    ].second;
+		e2   = &smooth[i + 1].first;
+		dor2 = &smooth[i + 1].second;
+	}
+	void table_entries(sz i, const float*& e1, const float*& dor1, const float*& e2, const float*& dor2) const {
+		assert(2 * i + 3 < compact.size());
+		e1   = &compact[2 * i];
+		dor1 = e1 + 1;
+		e2   = e1 + 2;
+		dor2 = e1 + 3;
+	}
+	void init_compact() {
+		compact.resize(2 * smooth.size());
+		VINA_FOR_IN(i, smooth) {
+			compact[2 * i    ] = float(smooth[i].first);
+			compact[2 * i + 1] = float(smooth[i].second);
+		}
+	}
 	void init_from_smooth_fst(const flv& rs) {
 		sz n = smooth.size();
 		VINA_CHECK(rs.size() == n);
@@ -105,34 +138,39 @@ struct precalculate_element {
 	}
 	flv fast;
 	prv smooth; // [(e, dor)]
+	std::vector<float> compact; // [e, dor, e, dor, ...] of smooth, if the precalculate is compact
 	fl factor;
 };
 
+// A compact precalculate only has the tables of the pairs of the atom types it is given, typically those of
+// a model, and looks up e and dor in float tables that keep them side by side: a fraction of the memory of the
+// full tables, of which the searches only touch a few. The float tables change the energies by about 5e-8 and
+// the forces by about 3e-7, relative.
 struct precalculate {
 	precalculate(const scoring_function& sf, fl v = max_fl, fl factor_ = 32) : // sf should not be discontinuous, even near cutoff, for the sake of the derivatives
 		m_cutoff_sqr(sqr(sf.cutoff())),
 		n(sz(factor_ * m_cutoff_sqr) + 3),  // sz(factor * r^2) + 1 <= sz(factor * cutoff_sqr) + 2 <= n-1 < n  // see assert below
 		factor(factor_),
+		m_atom_typing_used(sf.atom_typing_used()),
+		m_compact(false),
 
-		data(num_atom_types(sf.atom_typing_used()), precalculate_element(n, factor_)),
-		m_atom_typing_used(sf.atom_typing_used()) {
+		data(num_atom_types(sf.atom_typing_used()), precalculate_element(n, factor_)) {
 
-		VINA_CHECK(factor > epsilon_fl);
-		VINA_CHECK(sz(m_cutoff_sqr*factor) + 1 < n); // cutoff_sqr * factor is the largest float we may end up converting into sz, then 1 can be added to the result
-		VINA_CHECK(m_cutoff_sqr*factor + 1 < n);
-
-		flv rs = calculate_rs();
+		szv types;
+		VINA_FOR(t, data.dim())
+			types.push_back(t);
+		init(sf, types, v);
+	}
+	precalculate(const scoring_function& sf, const szv& types, fl v = max_fl, fl factor_ = 32) : // compact
+		m_cutoff_sqr(sqr(sf.cutoff())),
+		n(sz(factor_ * m_cutoff_sqr) + 3),
+		factor(factor_),
+		m_atom_typing_used(sf.atom_typing_used()),
+		m_compact(true),
 
-		VINA_FOR(t1, data.dim())
-			VINA_RANGE(t2, t1, data.dim()) {
-				precalculate_element& p = data(t1, t2);
-				// init smooth[].first
-				VINA_FOR_IN(i, p.smooth)
-					p.smooth[i].first = (std::min)(v, sf.eval(t1, t2, rs[i]));
+		data(num_atom_types(sf.atom_typing_used()), precalculate_element(0, factor_)) { // only those of types are sized
 
-				// init the rest
-				p.init_from_smooth_fst(rs);
-			}
+		init(sf, types, v);
 	}
 	fl eval_fast(sz type_pair_index, fl r2) const {
 		assert(r2 <= m_cutoff_sqr);
@@ -140,18 +178,52 @@ struct precalculate {
 	}
 	pr eval_deriv(sz type_pair_index, fl r2) const {
 		assert(r2 <= m_cutoff_sqr);
+		if(m_compact)
+			return data(type_pair_index).eval_deriv_compact(r2);
 		return data(type_pair_index).eval_deriv(r2);
 	}
+	bool compact() const { return m_compact; }
+	const precalculate_element& element(sz type_pair_index) const { return data(type_pair_index); } // for kernels that interpolate several pairs at once
 	sz index_permissive(sz t1, sz t2) const { return data.index_permissive(t1, t2); }
 	atom_type::t atom_typing_used() const { return m_atom_typing_used; }
 	fl cutoff_sqr() const { return m_cutoff_sqr; }
 	void widen(fl left, fl right) {
 		flv rs = calculate_rs();
 		VINA_FOR(t1, data.dim())
-			VINA_RANGE(t2, t1, data.dim())
-				data(t1, t2).widen(rs, left, right);
+			VINA_RANGE(t2, t1, data.dim()) {
+				precalculate_element& p = data(t1, t2);
+				if(p.smooth.empty()) continue; // not a pair of a compact precalculate
+				p.widen(rs, left, right);
+				if(m_compact)
+					p.init_compact();
+			}
 	}
 private:
+	void init(const scoring_function& sf, const szv& types, fl v) {
+		VINA_CHECK(factor > epsilon_fl);
+		VINA_CHECK(sz(m_cutoff_sqr*factor) + 1 < n); // cutoff_sqr * factor is the largest float we may end up converting into sz, then 1 can be added to the result
+		VINA_CHECK(m_cutoff_sqr*factor + 1 < n);
+
+		flv rs = calculate_rs();
+
+		VINA_FOR_IN(a, types)
+			VINA_RANGE(b, a, types.size()) {
+				const sz t1 = (std::min)(types[a], types[b]);
+				const sz t2 = (std::max)(types[a], types[b]);
+				VINA_CHECK(t2 < data.dim());
+				precalculate_element& p = data(t1, t2);
+				if(m_compact)
+					p = precalculate_element(n, factor);
+				// init smooth[].first
+				VINA_FOR_IN(i, p.smooth)
+					p.smooth[i].first = (std::min)(v, sf.eval(t1, t2, rs[i]));
+
+				// init the rest
+				p.init_from_smooth_fst(rs);
+				if(m_compact)
+					p.init_compact();
+			}
+	}
 	flv calculate_rs() const {
 		flv tmp(n, 0);
 		VINA_FOR(i, n)
@@ -162,8 +234,28 @@ private:
 	sz n;
 	fl factor;
 	atom_type::t m_atom_typing_used;
+	bool m_compact;
 
 	triangular_matrix<precalculate_element> data;
 };
 
+// e and dor of eval_deriv (eval_deriv_compact with T = float) in lanes, for the kernels of non_cache and model: those
+// of the type pair index of each lane, at the factor * r2 of the lane, interpolated as the scalar code does.
+template<typename T, typename Index> // Index: sz or boost::uint32_t
+inline void eval_deriv_lanes(const precalculate& p, const Index* type_pair_indexes, const fl_lanes& r2_factored, fl_lanes& e, fl_lanes& dor) {
+	fl r2_factored_lanes[fl_lanes::width];
+	r2_factored.store(r2_factored_lanes);
+	const T* e1[fl_lanes::width];
+	const T* dor1[fl_lanes::width];
+	const T* e2[fl_lanes::width];
+	const T* dor2[fl_lanes::width];
+	VINA_FOR(l, fl_lanes::width)
+		p.element(type_pair_indexes[l]).table_entries(sz(r2_factored_lanes[l]), e1[l], dor1[l], e2[l], dor2[l]);
+	const fl_lanes rem = r2_factored - truncate(r2_factored);
+	const fl_lanes e1_lanes = fl_lanes::gather(e1);
+	const fl_lanes dor1_lanes = fl_lanes::gather(dor1);
+	e = e1_lanes + rem * (fl_lanes::gather(e2) - e1_lanes);
+	dor = dor1_lanes + rem * (fl_lanes::gather(dor2) - dor1_lanes);
+}
+
 #endif
@@ -24,11 +24,13 @@
 #define VINA_QUASI_NEWTON_H
 
 #include "model.h"
+#include "bfgs.h"
 
 struct quasi_newton {
 	unsigned max_steps;
 	fl average_required_improvement;
-	quasi_newton() : max_steps(1000), average_required_improvement(0.0) {}
+	bfgs_counters* counters; // if not NULL, the work done is added up there
+	quasi_newton() : max_steps(1000), average_required_improvement(0.0), counters(NULL) {}
 	// clean up
 	void operator()(model& m, const precalculate& p, const igrid& ig, output_type& out, change& g, const vec& v) const; // g must have correct size
 };
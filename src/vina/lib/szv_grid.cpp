@@ -23,9 +23,10 @@
 #include "szv_grid.h"
 #include "brick.h"
 
-szv_grid::szv_grid(const model& m, const grid_dims& gd, fl cutoff_sqr) : m_data(gd[0].n, gd[1].n, gd[2].n) {
+szv_grid::szv_grid(const model& m, const grid_dims& gd, fl cutoff_sqr) {
 	vec end;
 	VINA_FOR_IN(i, gd) {
+		m_dims[i] = gd[i].n;
 		m_init[i] = gd[i].begin;
 		end   [i] = gd[i].end;
 	}
@@ -39,45 +40,83 @@ szv_grid::szv_grid(const model& m, const grid_dims& gd, fl cutoff_sqr) : m_data(
 		if(a.get(m.atom_typing_used()) < nat && brick_distance_sqr(m_init, end, a.coords) < cutoff_sqr)
 			relevant_indexes.push_back(i);
 	}
+	m_x.resize(relevant_indexes.size());
+	m_y.resize(relevant_indexes.size());
+	m_z.resize(relevant_indexes.size());
+	m_type.resize(relevant_indexes.size());
+	VINA_FOR_IN(ri, relevant_indexes) {
+		const atom& a = m.grid_atoms[relevant_indexes[ri]];
+		m_x[ri] = a.coords[0];
+		m_y[ri] = a.coords[1];
+		m_z[ri] = a.coords[2];
+		m_type[ri] = a.get(m.atom_typing_used());
+	}
 
-	VINA_FOR(x, m_data.dim0())
-	VINA_FOR(y, m_data.dim1())
-	VINA_FOR(z, m_data.dim2()) {
-		VINA_FOR_IN(ri, relevant_indexes) {
-			const sz i = relevant_indexes[ri];
-			const atom& a = m.grid_atoms[i];
-			if(brick_distance_sqr(index_to_coord(x, y, z), index_to_coord(x+1, y+1, z+1), a.coords) < cutoff_sqr)
-				m_data(x, y, z).push_back(i);
+	// each atom is only tested against the cells within the cutoff of it along every axis, rather than all of them;
+	// the atoms are still added in order, so that every cell gets the same list as testing them all would.
+	// The cells each atom reaches are noted first, which sizes the cells; they are then filled from the notes
+	const fl cutoff = std::sqrt(cutoff_sqr);
+	m_offsets.assign(m_dims[0] * m_dims[1] * m_dims[2] + 1, 0);
+	szv reached; // cells, atom after atom
+	szv reached_end(relevant_indexes.size()); // per atom, into reached
+	VINA_FOR_IN(ri, relevant_indexes) {
+		const vec a_coords(m_x[ri], m_y[ri], m_z[ri]);
+		boost::array<sz, 3> lo, hi; // the cells in reach, inclusive, with a cell to spare on either side of rounding
+		VINA_FOR_IN(j, lo) {
+			const fl cell = m_range[j] / m_dims[j];
+			const fl from = std::floor((a_coords[j] - cutoff - m_init[j]) / cell) - 1;
+			const fl to   = std::floor((a_coords[j] + cutoff - m_init[j]) / cell) + 1;
+			lo[j] = (from < 0) ? 0 : sz(from);
+			hi[j] = (to < 0) ? 0 : (std::min)(sz(to), m_dims[j] - 1);
 		}
+		VINA_RANGE(x, lo[0], hi[0] + 1)
+		VINA_RANGE(y, lo[1], hi[1] + 1)
+		VINA_RANGE(z, lo[2], hi[2] + 1)
+			if(brick_distance_sqr(index_to_coord(x, y, z), index_to_coord(x+1, y+1, z+1), a_coords) < cutoff_sqr) {
+				const sz c = cell_index(x, y, z);
+				reached.push_back(c);
+				++m_offsets[c + 1];
+			}
+		reached_end[ri] = reached.size();
 	}
+	VINA_FOR(c, m_offsets.size() - 1)
+		m_offsets[c + 1] += m_offsets[c];
+	m_indexes.resize(m_offsets.back());
+	szv filled(m_offsets.begin(), m_offsets.end() - 1); // per cell
+	sz k = 0;
+	VINA_FOR_IN(ri, relevant_indexes)
+		for(; k < reached_end[ri]; ++k)
+			m_indexes[filled[reached[k]]++] = ri;
 }
 
 fl szv_grid::average_num_possibilities() const {
-	sz counter = 0;
-	VINA_FOR(x, m_data.dim0())
-	VINA_FOR(y, m_data.dim1())
-	VINA_FOR(z, m_data.dim2()) {
-		counter += m_data(x, y, z).size();
-	}
-	return fl(counter) / (m_data.dim0() * m_data.dim1() * m_data.dim2());
+	return fl(m_indexes.size()) / (m_offsets.size() - 1);
 }
 
-const szv& szv_grid::possibilities(const vec& coords) const {
+szv_grid_atoms szv_grid::possibilities(const vec& coords) const {
 	boost::array<sz, 3> index;
 	VINA_FOR_IN(i, index) {
 		assert(coords[i] + epsilon_fl >= m_init[i]);
 		assert(coords[i] <= m_init[i] + m_range[i] + epsilon_fl);
-		const fl tmp = (coords[i] - m_init[i]) * m_data.dim(i) / m_range[i];
-		index[i] = fl_to_sz(tmp, m_data.dim(i) - 1);
+		const fl tmp = (coords[i] - m_init[i]) * m_dims[i] / m_range[i];
+		index[i] = fl_to_sz(tmp, m_dims[i] - 1);
 	}
-	return m_data(index[0], index[1], index[2]);
+	const sz c = cell_index(index[0], index[1], index[2]);
+	szv_grid_atoms tmp;
+	tmp.begin = m_indexes.empty() ? NULL : &m_indexes[0] + m_offsets[c];
+	tmp.end   = m_indexes.empty() ? NULL : &m_indexes[0] + m_offsets[c + 1];
+	tmp.x     = m_x.empty() ? NULL : &m_x[0];
+	tmp.y     = m_y.empty() ? NULL : &m_y[0];
+	tmp.z     = m_z.empty() ? NULL : &m_z[0];
+	tmp.type  = m_type.empty() ? NULL : &m_type[0];
+	return tmp;
 }
 
 vec szv_grid::index_to_coord(sz i, sz j, sz k) const {
 	vec index(i, j, k);
 	vec tmp;
 	VINA_FOR_IN(n, tmp) 
-		tmp[n] = m_init[n] + m_range[n] * index[n] / m_data.dim(n);
+		tmp[n] = m_init[n] + m_range[n] * index[n] / m_dims[n];
 	return tmp;
 }
 
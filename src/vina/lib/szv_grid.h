@@ -25,17 +25,32 @@
 
 #include "model.h"
 #include "grid_dim.h"
-#include "array3d.h"
+
+struct szv_grid_atoms { // the receptor atoms that can be within the cutoff of some point of a cell
+	const sz* begin; // indexes into x, y, z and type
+	const sz* end;
+	const fl* x;
+	const fl* y;
+	const fl* z;
+	const sz* type; // in the atom typing of the model, always assigned
+};
 
 struct szv_grid {
 	szv_grid(const model& m, const grid_dims& gd, fl cutoff_sqr);
-	const szv& possibilities(const vec& coords) const;
+	szv_grid_atoms possibilities(const vec& coords) const;
 	fl average_num_possibilities() const;
 private:
-	array3d<szv> m_data;
+	// the possibilities of the cells, in array3d order, are m_indexes[m_offsets[c] .. m_offsets[c+1]) - one flat array rather than a vector per cell
+	szv m_offsets;
+	szv m_indexes;
+	// the relevant receptor atoms, copied out of grid_atoms in their order, so that the lookups read contiguous arrays instead of atoms
+	flv m_x, m_y, m_z;
+	szv m_type;
+	boost::array<sz, 3> m_dims;
 	vec m_init;
 	vec m_range;
 	vec index_to_coord(sz i, sz j, sz k) const;
+	sz cell_index(sz x, sz y, sz z) const { return x + m_dims[0] * (y + m_dims[1] * z); }
 };
 
 grid_dims szv_grid_dims(const grid_dims& gd);
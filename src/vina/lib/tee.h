@@ -27,29 +27,31 @@
 #include "file.h"
 
 struct tee {
+	std::ostream* console;
 	ofile* of;
-	tee() : of(NULL) {}
+	tee() : console(&std::cout), of(NULL) {}
+	explicit tee(std::ostream& console_) : console(&console_), of(NULL) {} // instead of std::cout
 	void init(const path& name) {
 		of = new ofile(name);
 	}
 	virtual ~tee() { delete of; }
 	void flush() {
-		std::cout << std::flush;
+		(*console) << std::flush;
 		if(of)
 			(*of) << std::flush;
 	}
 	void endl() {
-		std::cout << std::endl;
+		(*console) << std::endl;
 		if(of)
 			(*of) << std::endl;
 	}
 	void setf(std::ios::fmtflags a) {
-		std::cout.setf(a);
+		console->setf(a);
 		if(of)
 			of->setf(a);
 	}
 	void setf(std::ios::fmtflags a, std::ios::fmtflags b) {
-		std::cout.setf(a, b);
+		console->setf(a, b);
 		if(of)
 			of->setf(a, b);
 	}
@@ -57,7 +59,7 @@ struct tee {
 
 template<typename T>
 tee& operator<<(tee& out, const T& x) {
-	std::cout << x;
+	(*out.console) << x;
 	if(out.of)
 		(*out.of) << x;
 	return out;
@@ -24,14 +24,27 @@
 #include <string>
 #include <exception>
 #include <vector> // ligand paths
+#include <map> // jobs by id, tables by weights
+#include <algorithm> // sort
+#include <deque> // job queue, tables kept
+#include <sstream> // PDBQT text given in memory, job logs
 #include <cmath> // for ceila
+#include <ctime> // clock
 #include <boost/program_options.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/exception.hpp>
 #include <boost/filesystem/convenience.hpp> // filesystem::basename
-#include <boost/thread/thread.hpp> // hardware_concurrency // FIXME rm ?
+#include <boost/thread/thread.hpp> // hardware_concurrency, job pool
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp> // interleaved grids
+#include <boost/thread/condition.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
+#include <boost/utility.hpp> // noncopyable
+#include <boost/scoped_ptr.hpp>
 #include "parse_pdbqt.h"
 #include "parallel_mc.h"
+#include "parallel_progress.h"
 #include "file.h"
 #include "cache.h"
 #include "non_cache.h"
@@ -42,8 +55,10 @@
 #include "current_weights.h"
 #include "quasi_newton.h"
 #include "tee.h"
+#include "my_pid.h"
 #include "coords.h" // add_to_output_container
 #include "vina_error.h"
+#include "main.h"
 
 using boost::filesystem::path;
 
@@ -71,6 +86,54 @@ std::string default_output(const std::string& input_name) {
 	return tmp + "_out.pdbqt";
 }
 
+void add_to_result(vina_result* result, const output_type& out, fl lb, fl ub, sz pocket = 0) {
+	if(!result) return;
+	vina_mode mode;
+	mode.energy = out.e;
+	mode.rmsd_lb = lb;
+	mode.rmsd_ub = ub;
+	mode.pocket = int(pocket);
+	mode.coords.reserve(3 * out.coords.size());
+	VINA_FOR_IN(i, out.coords)
+		VINA_FOR(j, 3)
+			mode.coords.push_back(out.coords[i][j]);
+	result->modes.push_back(mode);
+}
+
+struct phase_timer { // adds the wall and CPU time of its lifetime to the profile, if any
+	phase_timer(vina_profile* profile_, const std::string& name_)
+		: profile(profile_), name(name_), wall_start(boost::posix_time::microsec_clock::universal_time()), cpu_start(std::clock()) {}
+	~phase_timer() {
+		if(!profile) return;
+		const fl wall = (boost::posix_time::microsec_clock::universal_time() - wall_start).total_microseconds() * 1e-6;
+		const fl cpu = fl(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+		VINA_FOR_IN(i, profile->phases) {
+			vina_phase& ph = profile->phases[i];
+			if(ph.name == name) {
+				ph.wall += wall;
+				ph.cpu += cpu;
+				++ph.calls;
+				return;
+			}
+		}
+		vina_phase ph;
+		ph.name = name;
+		ph.wall = wall;
+		ph.cpu = cpu;
+		ph.calls = 1;
+		profile->phases.push_back(ph);
+	}
+private:
+	vina_profile* profile;
+	std::string name;
+	boost::posix_time::ptime wall_start;
+	std::clock_t cpu_start;
+};
+
+vina_profile* profile_of(vina_result* result) {
+	return result ? &result->profile : NULL;
+}
+
 void write_all_output(model& m, const output_container& out, sz how_many,
 				  const std::string& output_name,
 				  const std::vector<std::string>& remarks) {
@@ -114,10 +177,11 @@ void do_randomization(model& m,
 	m.write_structure(make_path(out_name));
 }
 
-void refine_structure(model& m, const precalculate& prec, non_cache& nc, output_type& out, const vec& cap, sz max_steps = 1000) {
+void refine_structure(model& m, const precalculate& prec, non_cache& nc, output_type& out, const vec& cap, sz max_steps = 1000, bfgs_counters* counters = NULL) {
 	change g(m.get_size());
 	quasi_newton quasi_newton_par;
 	quasi_newton_par.max_steps = max_steps;
+	quasi_newton_par.counters = counters;
 	const fl slope_orig = nc.slope;
 	VINA_FOR(p, 5) {
 		nc.slope = 100 * std::pow(10.0, 2.0*p);
@@ -151,11 +215,17 @@ output_container remove_redundant(const output_container& in, fl min_rmsd) {
 	return tmp;
 }
 
-void do_search(model& m, const boost::optional<model>& ref, const scoring_function& sf, const precalculate& prec, const igrid& ig, const precalculate& prec_widened, const igrid& ig_widened, non_cache& nc, // nc.slope is changed
+void do_search(model& m, const boost::optional<model>& ref, const scoring_function& sf, const precalculate& prec, const igrid& ig, const precalculate& prec_widened, const igrid& ig_widened,
+			   non_cache& nc, // of the whole search space, for local_only; nc.slope is changed
+			   std::vector<non_cache>& box_nc, // one per box, keeping its modes within it; likewise
 			   const std::string& out_name,
-			   const vec& corner1, const vec& corner2,
+			   const search_boxes& boxes, // searched at once, each with exhaustiveness tasks
+			   bool merge_boxes, // the boxes split one search space, so that their modes are merged, rather than pockets listed in turn
 			   const parallel_mc& par, fl energy_range, sz num_modes,
-			   int seed, int verbosity, bool score_only, bool local_only, tee& log, const terms& t, const flv& weights) {
+			   int seed, int verbosity, bool score_only, bool local_only, tee& log, const terms& t, const flv& weights,
+			   vina_result* result) { // the modes are also appended to *result, if not NULL, with their profile; out_name can be empty
+	vina_profile* profile = profile_of(result);
+	bfgs_counters counters;
 	conf_size s = m.get_size();
 	conf c = m.get_initial_conf();
 	fl e = max_fl;
@@ -163,7 +233,10 @@ void do_search(model& m, const boost::optional<model>& ref, const scoring_functi
 	if(score_only) {
 		fl intramolecular_energy = m.eval_intramolecular(prec, authentic_v, c);
 		naive_non_cache nnc(&prec); // for out of grid issues
-		e = m.eval_adjusted(sf, prec, nnc, authentic_v, c, intramolecular_energy);
+		{
+			phase_timer timer(profile, "eval_adjusted");
+			e = m.eval_adjusted(sf, prec, nnc, authentic_v, c, intramolecular_energy);
+		}
 		log << "Affinity: " << std::fixed << std::setprecision(5) << e << " (kcal/mol)";
 		log.endl();
 		flv term_values = t.evale_robust(m);
@@ -185,118 +258,379 @@ void do_search(model& m, const boost::optional<model>& ref, const scoring_functi
 			log << "WARNING: affinity. Consider reporting this as a bug:\n";
 			log << "WARNING: http://vina.scripps.edu/manual.html#bugs\n";
 		}
+		output_type out(c, e);
+		out.coords = m.get_heavy_atom_movable_coords();
+		add_to_result(result, out, 0, 0);
 	}
 	else if(local_only) {
 		output_type out(c, e);
 		doing(verbosity, "Performing local search", log);
-		refine_structure(m, prec, nc, out, authentic_v, par.mc.ssd_par.evals);
+		{
+			phase_timer timer(profile, "refine");
+			refine_structure(m, prec, nc, out, authentic_v, par.mc.ssd_par.evals, &counters);
+		}
 		done(verbosity, log);
 		fl intramolecular_energy = m.eval_intramolecular(prec, authentic_v, out.c);
-		e = m.eval_adjusted(sf, prec, nc, authentic_v, out.c, intramolecular_energy);
+		{
+			phase_timer timer(profile, "eval_adjusted");
+			e = m.eval_adjusted(sf, prec, nc, authentic_v, out.c, intramolecular_energy);
+		}
 
 		log << "Affinity: " << std::fixed << std::setprecision(5) << e << " (kcal/mol)";
 		log.endl();
 		if(!nc.within(m))
 			log << "WARNING: not all movable atoms are within the search space\n";
 
-		doing(verbosity, "Writing output", log);
-		output_container out_cont;
-		out_cont.push_back(new output_type(out));
-		std::vector<std::string> remarks(1, vina_remark(e, 0, 0));
-		write_all_output(m, out_cont, 1, out_name, remarks); // how_many == 1
-		done(verbosity, log);
+		out.e = e;
+		add_to_result(result, out, 0, 0);
+
+		if(!out_name.empty()) {
+			doing(verbosity, "Writing output", log);
+			output_container out_cont;
+			out_cont.push_back(new output_type(out));
+			std::vector<std::string> remarks(1, vina_remark(e, 0, 0));
+			phase_timer timer(profile, "write output");
+			write_all_output(m, out_cont, 1, out_name, remarks); // how_many == 1
+			done(verbosity, log);
+		}
 	}
 	else {
 		rng generator(static_cast<rng::result_type>(seed));
 		log << "Using random seed: " << seed;
 		log.endl();
-		output_container out_cont;
+		std::vector<output_container> out_conts; // one per box
 		doing(verbosity, "Performing search", log);
-		par(m, out_cont, prec, ig, prec_widened, ig_widened, corner1, corner2, generator);
+		{
+			phase_timer timer(profile, "monte carlo");
+			parallel_mc par_counted = par;
+			par_counted.counters = &counters;
+			par_counted(m, out_conts, prec, ig, prec_widened, ig_widened, boxes, generator);
+		}
 		done(verbosity, log);
 
 		doing(verbosity, "Refining results", log);
-		VINA_FOR_IN(i, out_cont)
-			refine_structure(m, prec, nc, out_cont[i], authentic_v, par.mc.ssd_par.evals);
-
-		if(!out_cont.empty()) {
-			out_cont.sort();
-			const fl best_mode_intramolecular_energy = m.eval_intramolecular(prec, authentic_v, out_cont[0].c);
-			VINA_FOR_IN(i, out_cont)
-				if(not_max(out_cont[i].e))
-					out_cont[i].e = m.eval_adjusted(sf, prec, nc, authentic_v, out_cont[i].c, best_mode_intramolecular_energy);
-			// the order must not change because of non-decreasing g (see paper), but we'll re-sort in case g is non strictly increasing
+		VINA_FOR_IN(b, out_conts) {
+			output_container& out_cont = out_conts[b];
+			VINA_FOR_IN(i, out_cont) {
+				phase_timer timer(profile, "refine");
+				refine_structure(m, prec, box_nc[b], out_cont[i], authentic_v, par.mc.ssd_par.evals, &counters);
+			}
 			out_cont.sort();
 		}
 
+		const output_type* best_of_all = NULL; // the intramolecular energies of merged modes are taken relative to the same one
+		if(merge_boxes)
+			VINA_FOR_IN(b, out_conts)
+				if(!out_conts[b].empty() && (!best_of_all || out_conts[b].front().e < best_of_all->e))
+					best_of_all = &out_conts[b].front();
+		const fl best_of_all_intramolecular_energy = best_of_all ? m.eval_intramolecular(prec, authentic_v, best_of_all->c) : 0;
+
 		const fl out_min_rmsd = 1;
-		out_cont = remove_redundant(out_cont, out_min_rmsd);
+		VINA_FOR_IN(b, out_conts) {
+			output_container& out_cont = out_conts[b];
+			if(!out_cont.empty()) {
+				const fl best_mode_intramolecular_energy = best_of_all ? best_of_all_intramolecular_energy : m.eval_intramolecular(prec, authentic_v, out_cont[0].c);
+				VINA_FOR_IN(i, out_cont)
+					if(not_max(out_cont[i].e)) {
+						phase_timer timer(profile, "eval_adjusted");
+						out_cont[i].e = m.eval_adjusted(sf, prec, box_nc[b], authentic_v, out_cont[i].c, best_mode_intramolecular_energy);
+					}
+				// the order must not change because of non-decreasing g (see paper), but we'll re-sort in case g is non strictly increasing
+				out_cont.sort();
+			}
+
+			out_cont = remove_redundant(out_cont, out_min_rmsd);
+		}
+
+		if(merge_boxes && out_conts.size() > 1) { // the overlapping boxes find some modes more than once
+			output_container merged;
+			sz max_size = 0;
+			VINA_FOR_IN(b, out_conts)
+				max_size += out_conts[b].size();
+			VINA_FOR_IN(b, out_conts)
+				merge_output_containers(out_conts[b], merged, out_min_rmsd, max_size);
+			out_conts.assign(1, merged);
+		}
 
 		done(verbosity, log);
 
 		log.setf(std::ios::fixed, std::ios::floatfield);
 		log.setf(std::ios::showpoint);
-		log << '\n';
-		log << "mode |   affinity | dist from best mode\n";
-		log << "     | (kcal/mol) | rmsd l.b.| rmsd u.b.\n";
-		log << "-----+------------+----------+----------\n";
 
-		model best_mode_model = m;
-		if(!out_cont.empty())
-			best_mode_model.set(out_cont.front().c);
-
-		sz how_many = 0;
+		output_container listed; // of all the boxes, in turn
 		std::vector<std::string> remarks;
-		VINA_FOR_IN(i, out_cont) {
-			if(how_many >= num_modes || !not_max(out_cont[i].e) || out_cont[i].e > out_cont[0].e + energy_range) break; // check energy_range sanity FIXME
-			++how_many;
-			log << std::setw(4) << i+1
-				<< "    " << std::setw(9) << std::setprecision(1) << out_cont[i].e; // intermolecular_energies[i];
-			m.set(out_cont[i].c);
-			const model& r = ref ? ref.get() : best_mode_model;
-			const fl lb = m.rmsd_lower_bound(r);
-			const fl ub = m.rmsd_upper_bound(r);
-			log << "  " << std::setw(9) << std::setprecision(3) << lb
-			    << "  " << std::setw(9) << std::setprecision(3) << ub; // FIXME need user-readable error messages in case of failures
-
-			remarks.push_back(vina_remark(out_cont[i].e, lb, ub));
-			log.endl();
+		szv how_many(out_conts.size(), 0);
+		VINA_FOR_IN(b, out_conts) {
+			const output_container& out_cont = out_conts[b];
+			log << '\n';
+			if(out_conts.size() > 1)
+				log << "pocket " << b+1 << '\n';
+			log << "mode |   affinity | dist from best mode\n";
+			log << "     | (kcal/mol) | rmsd l.b.| rmsd u.b.\n";
+			log << "-----+------------+----------+----------\n";
+
+			model best_mode_model = m;
+			if(!out_cont.empty())
+				best_mode_model.set(out_cont.front().c);
+
+			VINA_FOR_IN(i, out_cont) {
+				if(how_many[b] >= num_modes || !not_max(out_cont[i].e) || out_cont[i].e > out_cont[0].e + energy_range) break; // check energy_range sanity FIXME
+				++how_many[b];
+				log << std::setw(4) << i+1
+					<< "    " << std::setw(9) << std::setprecision(1) << out_cont[i].e; // intermolecular_energies[i];
+				m.set(out_cont[i].c);
+				const model& r = ref ? ref.get() : best_mode_model;
+				const fl lb = m.rmsd_lower_bound(r);
+				const fl ub = m.rmsd_upper_bound(r);
+				log << "  " << std::setw(9) << std::setprecision(3) << lb
+				    << "  " << std::setw(9) << std::setprecision(3) << ub; // FIXME need user-readable error messages in case of failures
+
+				std::string remark = vina_remark(out_cont[i].e, lb, ub);
+				if(out_conts.size() > 1)
+					remark += "REMARK VINA POCKET: " + to_string(b+1) + '\n';
+				remarks.push_back(remark);
+				listed.push_back(new output_type(out_cont[i]));
+				add_to_result(result, out_cont[i], lb, ub, b);
+				log.endl();
+			}
 		}
-		doing(verbosity, "Writing output", log);
-		write_all_output(m, out_cont, how_many, out_name, remarks);
-		done(verbosity, log);
+		if(!out_name.empty()) {
+			doing(verbosity, "Writing output", log);
+			phase_timer timer(profile, "write output");
+			write_all_output(m, listed, listed.size(), out_name, remarks);
+			done(verbosity, log);
+		}
+
+		VINA_FOR_IN(b, how_many)
+			if(how_many[b] < 1) {
+				log << "WARNING: Could not find any conformations completely within the search space";
+				if(how_many.size() > 1)
+					log << " of pocket " << b+1;
+				log << ".\n"
+					<< "WARNING: Check that it is large enough for all movable atoms, including those in the flexible side chains.";
+				log.endl();
+			}
+	}
+	if(profile) {
+		profile->evals              += counters.evals;
+		profile->bfgs_steps         += counters.steps;
+		profile->line_search_trials += counters.trials;
+	}
+}
 
-		if(how_many < 1) {
-			log << "WARNING: Could not find any conformations completely within the search space.\n"
-				<< "WARNING: Check that it is large enough for all movable atoms, including those in the flexible side chains.";
-			log.endl();
+const fl slope = 1e6; // FIXME: too large? used to be 100
+
+const fl precalculate_factor = 32; // table entries per Angstrom^2
+const fl widening = 0.25; // how far the tables of prec_widened are widened on each side
+
+typedef boost::shared_ptr<const precalculate> shared_precalculate; // immutable, so that any thread can use it
+
+struct precalculate_key { // everything the tables of the weighted terms of everything depend on
+	flv weights;
+	fl cutoff;
+	fl factor;
+	fl widening; // 0 if they are not widened
+	bool compact;
+	szv types; // sorted, if compact
+	precalculate_key(const flv& weights_, fl cutoff_, fl widening_, const szv* types_)
+		: weights(weights_), cutoff(cutoff_), factor(precalculate_factor), widening(widening_), compact(types_ != NULL) {
+		if(types_) {
+			types = *types_;
+			std::sort(types.begin(), types.end());
 		}
 	}
+	bool operator<(const precalculate_key& other) const {
+		if(weights  != other.weights)  return weights  < other.weights;
+		if(cutoff   != other.cutoff)   return cutoff   < other.cutoff;
+		if(factor   != other.factor)   return factor   < other.factor;
+		if(widening != other.widening) return widening < other.widening;
+		if(compact  != other.compact)  return compact  < other.compact;
+		return types < other.types;
+	}
+};
+
+// The tables already made by the process, kept for the later calls with the same weights: every
+// main_procedure and receptor session otherwise builds them again. Only the most recent ones are kept,
+// as compact tables differ with the atom types of the ligands; those still in use live on regardless.
+const sz max_precalculated = 32;
+boost::mutex precalculating; // guards the two below
+std::map<precalculate_key, shared_precalculate> precalculated;
+std::deque<precalculate_key> precalculated_order; // oldest first
+
+shared_precalculate find_precalculated(const precalculate_key& k) {
+	boost::mutex::scoped_lock lk(precalculating);
+	std::map<precalculate_key, shared_precalculate>::const_iterator it = precalculated.find(k);
+	if(it == precalculated.end())
+		return shared_precalculate();
+	return it->second;
 }
 
-void main_procedure(model& m, const boost::optional<model>& ref, // m is non-const (FIXME?)
-			     const std::string& out_name,
-				 bool score_only, bool local_only, bool randomize_only, bool no_cache,
-				 const grid_dims& gd, int exhaustiveness,
-				 const flv& weights,
-				 int cpu, int seed, int verbosity, sz num_modes, fl energy_range, tee& log) {
+shared_precalculate keep_precalculated(const precalculate_key& k, const shared_precalculate& p) { // or those another thread kept first
+	boost::mutex::scoped_lock lk(precalculating);
+	std::pair<std::map<precalculate_key, shared_precalculate>::iterator, bool> inserted = precalculated.insert(std::make_pair(k, p));
+	if(!inserted.second)
+		return inserted.first->second;
+	precalculated_order.push_back(k);
+	if(precalculated_order.size() > max_precalculated) {
+		precalculated.erase(precalculated_order.front());
+		precalculated_order.pop_front();
+	}
+	return p;
+}
 
-	doing(verbosity, "Setting up the scoring function", log);
+// the tables of sf, the weighted terms of everything with weights: compact for types, if any, and widened by widening, if not 0
+shared_precalculate timed_precalculate(const scoring_function& sf, const flv& weights, const szv* types, fl widening_, vina_profile* profile) {
+	const precalculate_key k(weights, sf.cutoff(), widening_, types);
+	shared_precalculate p = find_precalculated(k);
+	if(p)
+		return p;
+	shared_precalculate narrow;
+	if(widening_ > 0)
+		narrow = timed_precalculate(sf, weights, types, 0, profile);
+	phase_timer timer(profile, widening_ > 0 ? "widen" : "precalculate");
+	precalculate* tmp = NULL;
+	if(narrow) {
+		tmp = new precalculate(*narrow);
+		p.reset(tmp);
+		tmp->widen(widening_, widening_);
+	}
+	else if(types)
+		p.reset(new precalculate(sf, k.types, max_fl, precalculate_factor));
+	else
+		p.reset(new precalculate(sf, max_fl, precalculate_factor));
+	return keep_precalculated(k, p);
+}
 
-	everything t;
-	VINA_CHECK(weights.size() == 6);
+grid_storage grid_storage_from(const std::string& name) { // check_settings has made sure that name is known
+	if(name == "float") return grid_float;
+	if(name == "int16") return grid_int16;
+	return grid_double;
+}
 
-	weighted_terms wt(&t, weights);
-	precalculate prec(wt);
-	const fl left  = 0.25;
-	const fl right = 0.25;
-	precalculate prec_widened(prec); prec_widened.widen(left, right);
+grid_layout grid_layout_from(const std::string& name) { // likewise
+	if(name == "blocked") return grid_blocked;
+	if(name == "sparse")  return grid_sparse;
+	return grid_linear;
+}
 
-	done(verbosity, log);
+grid_interpolation grid_interpolation_from(const std::string& name) { // likewise
+	if(name == "tricubic") return grid_tricubic;
+	return grid_trilinear;
+}
 
-	vec corner1(gd[0].begin, gd[1].begin, gd[2].begin);
-	vec corner2(gd[0].end,   gd[1].end,   gd[2].end);
+grid_dims box_grid_dims(const vec& center, const vec& span, fl granularity) {
+	grid_dims gd;
+	VINA_FOR_IN(i, gd) {
+		gd[i].n = sz(std::ceil(span[i] / granularity));
+		fl real_span = granularity * gd[i].n;
+		gd[i].begin = center[i] - real_span/2;
+		gd[i].end = gd[i].begin + real_span;
+	}
+	return gd;
+}
+
+std::vector<grid_dims> pocket_grid_dims(const search_settings& settings) { // one per pocket
+	std::vector<grid_dims> tmp;
+	VINA_FOR_IN(i, settings.pockets) {
+		const vina_pocket& p = settings.pockets[i];
+		tmp.push_back(box_grid_dims(vec(p.center_x, p.center_y, p.center_z), vec(p.size_x, p.size_y, p.size_z), settings.grid_spacing));
+	}
+	return tmp;
+}
 
+const fl split_volume = 27000; // Angstrom^3; larger search spaces are harder to search at the default exhaustiveness
+const fl split_overlap = 10; // Angstrom; a ligand across the border of two sub-boxes lies within one of them, unless it is longer
+
+std::vector<grid_dims> split_grid_dims(const grid_dims& gd) { // sub-boxes of about split_volume at most, overlapping by split_overlap, on the grid points of gd
+	fl volume = 1;
+	VINA_FOR_IN(i, gd)
+		volume *= gd[i].span();
+	if(volume <= split_volume)
+		return std::vector<grid_dims>(1, gd);
+	const fl edge = std::pow(split_volume, 1.0 / 3);
+	boost::array<szv, 3> starts; // of the sub-boxes along each axis, in grid intervals
+	boost::array<sz, 3> lengths;
+	VINA_FOR_IN(i, gd) {
+		const sz n = gd[i].n;
+		const fl spacing = gd[i].span() / n;
+		sz k = 1; // sub-boxes along the axis
+		if(gd[i].span() > edge)
+			k = sz(std::ceil((gd[i].span() - split_overlap) / (edge - split_overlap)));
+		const sz overlap = sz(std::ceil(split_overlap / spacing));
+		lengths[i] = (std::min)(n, (n + (k - 1) * overlap + k - 1) / k);
+		VINA_FOR(j, k)
+			starts[i].push_back((k == 1) ? 0 : j * (n - lengths[i]) / (k - 1)); // the first at the beginning of gd, the last at its end
+	}
+	std::vector<grid_dims> tmp;
+	VINA_FOR_IN(x, starts[0])
+		VINA_FOR_IN(y, starts[1])
+			VINA_FOR_IN(z, starts[2]) {
+				const sz start[3] = { starts[0][x], starts[1][y], starts[2][z] };
+				grid_dims sub;
+				VINA_FOR_IN(i, sub) {
+					const fl spacing = gd[i].span() / gd[i].n;
+					sub[i].n = lengths[i];
+					sub[i].begin = gd[i].begin + start[i] * spacing;
+					sub[i].end = sub[i].begin + lengths[i] * spacing;
+				}
+				tmp.push_back(sub);
+			}
+	return tmp;
+}
+
+grid_dims box_grid_dims(const search_settings& settings) { // covering all the pockets, if there are any
+	if(settings.pockets.empty())
+		return box_grid_dims(vec(settings.center_x, settings.center_y, settings.center_z), vec(settings.size_x, settings.size_y, settings.size_z), settings.grid_spacing);
+	const std::vector<grid_dims> pockets = pocket_grid_dims(settings);
+	vec lo, hi;
+	VINA_FOR(j, 3) {
+		lo[j] = pockets.front()[j].begin;
+		hi[j] = pockets.front()[j].end;
+		VINA_FOR_IN(i, pockets) {
+			lo[j] = (std::min)(lo[j], pockets[i][j].begin);
+			hi[j] = (std::max)(hi[j], pockets[i][j].end);
+		}
+	}
+	return box_grid_dims(0.5 * (lo + hi), hi - lo, settings.grid_spacing);
+}
+
+path grid_file(const cache& c, const model& receptor, const std::string& cache_dir) { // empty if the grids are not to be kept
+	if(cache_dir.empty())
+		return path();
+	return make_path(cache_dir) / c.file_name(receptor);
+}
+
+void load_grids(cache& c, const model& receptor, const path& name) { // a missing or stale file only means that the grids get computed again
+	if(name.empty() || !boost::filesystem::exists(name))
+		return;
+	try {
+		c.read(name, receptor);
+	}
+	catch(cache_mismatch&) {}
+	catch(file_error&) {}
+}
+
+boost::mutex saving_grids; // the temporary file is per process
+
+void save_grids(const cache& c, const model& receptor, const path& name, tee& log) { // replaces the file at once, so that readers never see it half written
+	if(name.empty())
+		return;
+	boost::mutex::scoped_lock lk(saving_grids);
+	const path tmp = make_path(name.string() + "." + to_string(my_pid()) + ".tmp");
+	try {
+		boost::filesystem::create_directories(name.parent_path());
+		c.write(tmp, receptor);
+		if(boost::filesystem::exists(name))
+			boost::filesystem::remove(name);
+		boost::filesystem::rename(tmp, name);
+	}
+	catch(...) {
+		log << "WARNING: could not save the grid maps to " << name.string();
+		log.endl();
+	}
+}
+
+parallel_mc make_parallel_mc(const model& m, int exhaustiveness, int cpu, int verbosity) {
 	parallel_mc par;
 	sz heuristic = m.num_movable_atoms() + 10 * m.get_size().num_degrees_of_freedom();
 	par.mc.num_steps = unsigned(70 * 3 * (50 + heuristic) / 2); // 2 * 70 -> 8 * 20 // FIXME
@@ -307,92 +641,297 @@ void main_procedure(model& m, const boost::optional<model>& ref, // m is non-con
 	par.num_tasks = exhaustiveness;
 	par.num_threads = cpu;
 	par.display_progress = (verbosity > 1);
+	return par;
+}
+
+void main_procedure(model& m, const boost::optional<model>& ref, // m is non-const (FIXME?)
+			     const std::string& out_name,
+				 bool score_only, bool local_only, bool randomize_only, bool no_cache,
+				 const grid_dims& gd, const search_settings& grid_settings, int exhaustiveness, // only the grid settings and cache_dir of grid_settings are used
+				 const flv& weights, bool compact_tables,
+				 int cpu, int seed, int verbosity, sz num_modes, fl energy_range, tee& log, vina_result* result) {
+
+	doing(verbosity, "Setting up the scoring function", log);
+
+	everything t;
+	VINA_CHECK(weights.size() == 6);
+
+	weighted_terms wt(&t, weights);
+	const szv types = m.get_atom_types(wt.atom_typing_used());
+	const szv* compact_types = compact_tables ? &types : NULL;
+	const shared_precalculate shared_prec         = timed_precalculate(wt, weights, compact_types, 0,        profile_of(result));
+	const shared_precalculate shared_prec_widened = timed_precalculate(wt, weights, compact_types, widening, profile_of(result));
+	const precalculate& prec         = *shared_prec;
+	const precalculate& prec_widened = *shared_prec_widened;
+
+	done(verbosity, log);
+
+	vec corner1(gd[0].begin, gd[1].begin, gd[2].begin);
+	vec corner2(gd[0].end,   gd[1].end,   gd[2].end);
+
+	parallel_mc par = make_parallel_mc(m, exhaustiveness, cpu, verbosity);
 
-	const fl slope = 1e6; // FIXME: too large? used to be 100
 	if(randomize_only) {
 		do_randomization(m, out_name,
 			             corner1, corner2, seed, verbosity, log);
 	}
 	else {
+		const search_boxes boxes(1, search_box(corner1, corner2));
 		non_cache nc        (m, gd, &prec,         slope); // if gd has 0 n's, this will not constrain anything
 		non_cache nc_widened(m, gd, &prec_widened, slope); // if gd has 0 n's, this will not constrain anything
+		std::vector<non_cache> box_nc(1, nc);
 		if(no_cache) {
-			do_search(m, ref, wt, prec, nc, prec_widened, nc_widened, nc,
+			do_search(m, ref, wt, prec, nc, prec_widened, nc_widened, nc, box_nc,
 					  out_name,
-					  corner1, corner2,
+					  boxes, false,
 					  par, energy_range, num_modes,
-					  seed, verbosity, score_only, local_only, log, t, weights);
+					  seed, verbosity, score_only, local_only, log, t, weights, result);
 		}
 		else {
 			bool cache_needed = !(score_only || randomize_only || local_only);
 			if(cache_needed) doing(verbosity, "Analyzing the binding site", log);
-			cache c("scoring_function_version001", gd, slope, atom_type::XS);
-			if(cache_needed) c.populate(m, prec, m.get_movable_atom_types(prec.atom_typing_used()));
+			cache c("scoring_function_version001", gd, slope, atom_type::XS, grid_storage_from(grid_settings.grid_storage), grid_layout_from(grid_settings.grid_layout),
+			        grid_settings.grid_interleave, grid_interpolation_from(grid_settings.grid_interpolation), grid_settings.grid_lazy);
+			if(cache_needed) {
+				const path grids_name = grid_file(c, m, grid_settings.cache_dir);
+				{
+					phase_timer timer(profile_of(result), "load grids");
+					load_grids(c, m, grids_name);
+				}
+				sz computed = 0;
+				{
+					phase_timer timer(profile_of(result), "populate");
+					computed = c.populate(m, prec, m.get_movable_atom_types(prec.atom_typing_used()), verbosity > 1, sz(cpu));
+				}
+				if(computed > 0 && !c.populates_lazily()) {
+					phase_timer timer(profile_of(result), "save grids");
+					save_grids(c, m, grids_name, log);
+				}
+			}
 			if(cache_needed) done(verbosity, log);
-			do_search(m, ref, wt, prec, c, prec, c, nc,
+			do_search(m, ref, wt, prec, c, prec, c, nc, box_nc,
 					  out_name,
-					  corner1, corner2,
+					  boxes, false,
 					  par, energy_range, num_modes,
-					  seed, verbosity, score_only, local_only, log, t, weights);
+					  seed, verbosity, score_only, local_only, log, t, weights, result);
+		}
+	}
+}
+
+struct receptor_session : private boost::noncopyable { // everything that depends only on the receptor, reused for every ligand docked against it
+	model receptor;
+	grid_dims gd;
+	everything t;
+	flv weights;
+	weighted_terms wt;
+	vina_profile setup; // reported with the first docking
+	bool setup_reported;
+	bool compact_tables; // every docking then scores its searches with tables of its own atom types, the grids still being computed from prec
+	shared_precalculate prec;
+	cache c; // grids are only added for the atom types new ligands bring in
+	search_boxes boxes; // searched at once by every docking: the box of the grids, the sub-boxes it is split into, or each pocket within it
+	bool merge_boxes; // if they are sub-boxes
+	non_cache nc; // of the box of the grids, copied by every docking, since refine_structure changes nc.slope
+	std::vector<non_cache> box_nc; // one per box, likewise
+	boost::mutex populating; // concurrent dockings add their grids one at a time
+	boost::shared_mutex regrowing; // interleaved grids are replaced when atom types are added, which has to wait for the searches using them
+	boost::mutex jobs_mutex; // guards the two below
+	sz jobs_pending; // background dockings still using the session
+	bool released; // by the caller, to be deleted when no job uses it anymore
+	path grids_name; // where the grids are kept between runs, empty if they are not
+	receptor_session(const model& receptor_, const grid_dims& gd_, const flv& weights_, const vina_profile& parsing, // parsing the receptor is part of the setup
+					 const search_settings& settings) // only the grid and table settings and pockets are used
+		: receptor(receptor_), gd(gd_), weights(weights_), wt(&t, weights), setup(parsing), setup_reported(false), compact_tables(settings.compact_tables),
+		  prec(timed_precalculate(wt, weights, NULL, 0, &setup)),
+		  c("scoring_function_version001", gd, slope, atom_type::XS, grid_storage_from(settings.grid_storage), grid_layout_from(settings.grid_layout), settings.grid_interleave,
+		    grid_interpolation_from(settings.grid_interpolation), settings.grid_lazy),
+		  merge_boxes(false), nc(receptor, gd, prec.get(), slope), // only the grid atoms of the receptor are looked at
+		  jobs_pending(0), released(false), grids_name(grid_file(c, receptor, settings.cache_dir)) {
+		VINA_CHECK(weights.size() == 6);
+		std::vector<grid_dims> box_gd(1, gd);
+		if(!settings.pockets.empty())
+			box_gd = pocket_grid_dims(settings);
+		else if(settings.split_box) {
+			box_gd = split_grid_dims(gd);
+			merge_boxes = true;
+		}
+		const fl box_slope = (box_gd.size() > 1 || !settings.pockets.empty()) ? slope : 0; // the grids only keep the ligands in the whole box
+		VINA_FOR_IN(i, box_gd) {
+			boxes.push_back(search_box(vec(box_gd[i][0].begin, box_gd[i][1].begin, box_gd[i][2].begin),
+			                           vec(box_gd[i][0].end,   box_gd[i][1].end,   box_gd[i][2].end), box_slope));
+			box_nc.push_back(non_cache(receptor, box_gd[i], prec.get(), slope));
+		}
+		phase_timer timer(&setup, "load grids");
+		load_grids(c, receptor, grids_name);
+	}
+};
+
+void session_procedure(receptor_session& rs, model& m, const boost::optional<model>& ref, // m is the receptor with the ligand appended
+				 const std::string& out_name, const search_settings& settings, tee& log, vina_result* result, progress_monitor* monitor) {
+	parallel_mc par = make_parallel_mc(m, settings.exhaustiveness, settings.cpu, settings.verbosity);
+	par.monitor = monitor;
+
+	bool cache_needed = !(settings.score_only || settings.local_only);
+	if(cache_needed) {
+		doing(settings.verbosity, "Analyzing the binding site", log);
+		boost::mutex::scoped_lock lk(rs.populating);
+		boost::unique_lock<boost::shared_mutex> regrowing_lk(rs.regrowing, boost::defer_lock);
+		if(rs.c.interleaving())
+			regrowing_lk.lock();
+		sz computed = 0;
+		{
+			phase_timer timer(profile_of(result), "populate");
+			computed = rs.c.populate(m, *rs.prec, m.get_movable_atom_types(rs.prec->atom_typing_used()), settings.verbosity > 1, sz(settings.cpu)); // no-op for the atom types seen before
+		}
+		if(computed > 0 && !rs.c.populates_lazily()) {
+			phase_timer timer(profile_of(result), "save grids");
+			save_grids(rs.c, rs.receptor, rs.grids_name, log);
 		}
+		done(settings.verbosity, log);
+	}
+	boost::shared_lock<boost::shared_mutex> regrowing_lk(rs.regrowing, boost::defer_lock);
+	if(rs.c.interleaving())
+		regrowing_lk.lock();
+	shared_precalculate shared_prec = rs.prec;
+	if(rs.compact_tables) {
+		const szv types = m.get_atom_types(rs.prec->atom_typing_used());
+		shared_prec = timed_precalculate(rs.wt, rs.weights, &types, 0, profile_of(result));
+	}
+	const precalculate& prec = *shared_prec;
+	non_cache nc(rs.nc, &prec);
+	std::vector<non_cache> box_nc;
+	VINA_FOR_IN(i, rs.box_nc)
+		box_nc.push_back(non_cache(rs.box_nc[i], &prec));
+	do_search(m, ref, rs.wt, prec, rs.c, prec, rs.c, nc, box_nc,
+			  out_name,
+			  rs.boxes, rs.merge_boxes,
+			  par, settings.energy_range, static_cast<sz>(settings.num_modes),
+			  settings.seed, settings.verbosity, settings.score_only, settings.local_only, log, rs.t, rs.weights, result);
+}
+
+struct pdbqt_reader : private boost::noncopyable { // opens the file, unless the text is already in memory
+	path name;
+	pdbqt_reader(const pdbqt_input& input) : name(make_path(input.name)) {
+		if(input.text)
+			text.str(input.text.get());
+		else
+			file.reset(new ifile(name));
+	}
+	std::istream& in() {
+		if(file)
+			return *file;
+		return text;
 	}
+private:
+	boost::scoped_ptr<ifile> file;
+	std::istringstream text;
+};
+
+model parse_ligand(const pdbqt_input& ligand) {
+	pdbqt_reader r(ligand);
+	return parse_ligand_pdbqt(r.in(), r.name);
+}
+
+void dock_in_session(receptor_session& rs, const pdbqt_input& ligand, const std::string& out_name, const search_settings& settings, tee& log, vina_result* result,
+					 progress_monitor* monitor = NULL) { // polled by other threads, if not NULL
+	if(result) {
+		boost::mutex::scoped_lock lk(rs.jobs_mutex);
+		if(!rs.setup_reported) {
+			result->profile = rs.setup;
+			rs.setup_reported = true;
+		}
+	}
+	doing(settings.verbosity, "Reading input", log);
+	model m = rs.receptor;
+	{
+		phase_timer timer(profile_of(result), "parse ligand");
+		m.append(parse_ligand(ligand));
+	}
+	boost::optional<model> ref;
+	done(settings.verbosity, log);
+
+	session_procedure(rs, m, ref, out_name, settings, log, result, monitor);
 }
 
 struct usage_error : public std::runtime_error {
 	usage_error(const std::string& message) : std::runtime_error(message) {}
 };
 
-model parse_bundle(const std::string& rigid_name, const boost::optional<std::string>& flex_name_opt, const std::vector<std::string>& ligand_names) {
-	model tmp = (flex_name_opt) ? parse_receptor_pdbqt(make_path(rigid_name), make_path(flex_name_opt.get()))
-		                        : parse_receptor_pdbqt(make_path(rigid_name));
-	VINA_FOR_IN(i, ligand_names)
-		tmp.append(parse_ligand_pdbqt(make_path(ligand_names[i])));
+model parse_receptor(const pdbqt_input& rigid, const boost::optional<pdbqt_input>& flex_opt, vina_profile* profile = NULL) {
+	phase_timer timer(profile, "parse receptor");
+	pdbqt_reader rigid_reader(rigid);
+	if(!flex_opt)
+		return parse_receptor_pdbqt(rigid_reader.in(), rigid_reader.name);
+	pdbqt_reader flex_reader(flex_opt.get());
+	return parse_receptor_pdbqt(rigid_reader.in(), rigid_reader.name, flex_reader.in(), flex_reader.name);
+}
+
+model parse_bundle(const pdbqt_input& rigid, const boost::optional<pdbqt_input>& flex_opt, const std::vector<pdbqt_input>& ligands) {
+	model tmp = parse_receptor(rigid, flex_opt);
+	VINA_FOR_IN(i, ligands)
+		tmp.append(parse_ligand(ligands[i]));
 	return tmp;
 }
 
-model parse_bundle(const std::vector<std::string>& ligand_names) {
-	VINA_CHECK(!ligand_names.empty()); // FIXME check elsewhere
-	model tmp = parse_ligand_pdbqt(make_path(ligand_names[0]));
-	VINA_RANGE(i, 1, ligand_names.size())
-		tmp.append(parse_ligand_pdbqt(make_path(ligand_names[i])));
+model parse_bundle(const std::vector<pdbqt_input>& ligands) {
+	VINA_CHECK(!ligands.empty()); // FIXME check elsewhere
+	model tmp = parse_ligand(ligands[0]);
+	VINA_RANGE(i, 1, ligands.size())
+		tmp.append(parse_ligand(ligands[i]));
 	return tmp;
 }
 
-model parse_bundle(const boost::optional<std::string>& rigid_name_opt, const boost::optional<std::string>& flex_name_opt, const std::vector<std::string>& ligand_names) {
-	if(rigid_name_opt)
-		return parse_bundle(rigid_name_opt.get(), flex_name_opt, ligand_names);
+model parse_bundle(const boost::optional<pdbqt_input>& rigid_opt, const boost::optional<pdbqt_input>& flex_opt, const std::vector<pdbqt_input>& ligands, vina_profile* profile = NULL) {
+	phase_timer timer(profile, "parse");
+	if(rigid_opt)
+		return parse_bundle(rigid_opt.get(), flex_opt, ligands);
 	else
-		return parse_bundle(ligand_names);
+		return parse_bundle(ligands);
 }
 
-int main_with_args(const boost::optional<std::string>& rigid_name_opt,
-	const boost::optional<std::string>& flex_name_opt,
-	std::string ligand_name,
-	const boost::optional<std::string>& out_name_opt) {
-	fl center_x=109.00,
-		center_y=40.12,
-		center_z=46.50,
-		size_x=10.50,
-		size_y=10.12,
-		size_z=10.50;
+search_settings::search_settings() : center_x(109.00), center_y(40.12), center_z(46.50),
+                                     size_x(10.50), size_y(10.12), size_z(10.50),
+                                     cpu(0), seed(auto_seed()), exhaustiveness(8), verbosity(2), num_modes(9), energy_range(2.0),
+                                     score_only(false), local_only(false), randomize_only(false), grid_storage("double"), grid_layout("linear"), grid_interleave(false),
+                                     grid_spacing(0.375), grid_interpolation("trilinear"), grid_lazy(false), compact_tables(false), split_box(false) {}
 
-	int cpu = 1, seed, exhaustiveness=8, verbosity = 2, num_modes = 9;
-	fl energy_range = 2.0;
+void check_settings(const search_settings& settings) {
+	if(settings.size_x <= 0 || settings.size_y <= 0 || settings.size_z <= 0)
+		throw usage_error("Search space dimensions should be positive");
+	if(settings.exhaustiveness < 1)
+		throw usage_error("exhaustiveness must be 1 or greater");
+	if(settings.num_modes < 1)
+		throw usage_error("num_modes must be 1 or greater");
+	if(settings.cpu < 0)
+		throw usage_error("cpu must be 0 (all the detected cores) or greater");
+	if(settings.grid_storage != "double" && settings.grid_storage != "float" && settings.grid_storage != "int16")
+		throw usage_error("grid_storage must be \"double\", \"float\" or \"int16\"");
+	if(settings.grid_layout != "linear" && settings.grid_layout != "blocked" && settings.grid_layout != "sparse")
+		throw usage_error("grid_layout must be \"linear\", \"blocked\" or \"sparse\"");
+	if(!(settings.grid_spacing > 0))
+		throw usage_error("grid_spacing should be positive");
+	if(settings.grid_interpolation != "trilinear" && settings.grid_interpolation != "tricubic")
+		throw usage_error("grid_interpolation must be \"trilinear\" or \"tricubic\"");
+	if(settings.grid_lazy && (settings.grid_storage == "int16" || settings.grid_layout == "sparse" || settings.grid_interleave))
+		throw usage_error("grid_lazy works with the \"double\" and \"float\" grid_storage, and neither the \"sparse\" grid_layout nor grid_interleave");
+	VINA_FOR_IN(i, settings.pockets) {
+		const vina_pocket& p = settings.pockets[i];
+		if(p.size_x <= 0 || p.size_y <= 0 || p.size_z <= 0)
+			throw usage_error("Pocket dimensions should be positive");
+	}
+	if(!settings.pockets.empty() && settings.split_box)
+		throw usage_error("split_box splits the box of center and size, not pockets");
+	if(!settings.pockets.empty() && (settings.score_only || settings.local_only || settings.randomize_only))
+		throw usage_error("pockets are only searched by a full docking, not with score_only, local_only or randomize_only");
+}
 
+flv default_weights() {
 	fl weight_gauss1      = -0.035579;
 	fl weight_gauss2      = -0.005156;
 	fl weight_repulsion   =  0.840245;
 	fl weight_hydrophobic = -0.035069;
 	fl weight_hydrogen    = -0.587439;
 	fl weight_rot         =  0.05846;
-	bool score_only = false, local_only = false, randomize_only = false, help = false, help_advanced = false, version = false; // FIXME
-
-	bool search_box_needed = !score_only; // randomize_only and local_only still need the search space
-	bool output_produced   = !score_only;
-	bool receptor_needed   = !randomize_only;
-
-	grid_dims gd; // n's = 0 via default c'tor
-	tee log;
 
 	flv weights;
 	weights.push_back(weight_gauss1);
@@ -401,21 +940,14 @@ int main_with_args(const boost::optional<std::string>& rigid_name_opt,
 	weights.push_back(weight_hydrophobic);
 	weights.push_back(weight_hydrogen);
 	weights.push_back(5 * weight_rot / 0.1 - 1); // linearly maps onto a different range, internally. see everything.cpp
+	return weights;
+}
 
-	if(search_box_needed) {
-		const fl granularity = 0.375;
-		vec span(size_x,   size_y,   size_z);
-		vec center(center_x, center_y, center_z);
-		VINA_FOR_IN(i, gd) {
-			gd[i].n = sz(std::ceil(span[i] / granularity));
-			fl real_span = granularity * gd[i].n;
-			gd[i].begin = center[i] - real_span/2;
-			gd[i].end = gd[i].begin + real_span;
-		}
-	}
+int usable_cpus(const search_settings& settings, tee& log) {
+	int cpu = settings.cpu;
 	if(cpu == 0) {
 		unsigned num_cpus = boost::thread::hardware_concurrency();
-		if(verbosity > 1) {
+		if(settings.verbosity > 1) {
 			if(num_cpus > 0)
 				log << "Detected " << num_cpus << " CPU" << ((num_cpus > 1) ? "s" : "") << '\n';
 			else
@@ -426,47 +958,85 @@ int main_with_args(const boost::optional<std::string>& rigid_name_opt,
 		else
 			cpu = 1;
 	}
-	if(cpu < 1)
-		cpu = 1;
-	if(verbosity > 1 && exhaustiveness < cpu)
+	if(settings.verbosity > 1 && settings.exhaustiveness < cpu)
 		log << "WARNING: at low exhaustiveness, it may be impossible to utilize all CPUs\n";
+	return cpu;
+}
 
-	doing(verbosity, "Reading input", log);
+int main_with_args(const boost::optional<pdbqt_input>& rigid_opt,
+	const boost::optional<pdbqt_input>& flex_opt,
+	const std::vector<pdbqt_input>& ligands,
+	const std::vector<std::string>& out_names, // either empty (no output files) or as long as ligands
+	search_settings settings,
+	std::vector<vina_result>* results) { // one per ligand, if not NULL
+	check_settings(settings);
 
-	model m       = parse_bundle(rigid_name_opt, flex_name_opt, std::vector<std::string>(1, ligand_name));
-	sz max_modes_sz = static_cast<sz>(num_modes);
-	boost::optional<model> ref;
-	done(verbosity, log);
+	bool search_box_needed = !settings.score_only; // randomize_only and local_only still need the search space
 
-	std::string out_name;
-	if(output_produced) { // FIXME
-		log << "accessing out_name_opt \n";
-		if(!out_name_opt) {
-			out_name = default_output(ligand_name);
-			log << "Output will be " << out_name << '\n';
-		} else {
-			out_name = out_name_opt.get();
-		}
+	if(ligands.empty())
+		throw usage_error("Missing ligand");
+	if(!out_names.empty() && out_names.size() != ligands.size())
+		throw usage_error("The number of output names must match the number of ligands");
+	if(!settings.pockets.empty() && !rigid_opt)
+		throw usage_error("pockets are searched within a receptor, which is missing");
+
+	grid_dims gd; // n's = 0 via default c'tor
+	tee log;
+
+	flv weights = default_weights();
+
+	if(search_box_needed)
+		gd = box_grid_dims(settings);
+	settings.cpu = usable_cpus(settings, log);
+
+	std::vector<std::string> out_names_used(ligands.size());
+	if(!out_names.empty() && !settings.score_only)
+		out_names_used = out_names;
+	if(results)
+		results->resize(ligands.size());
+
+	if(rigid_opt && !settings.randomize_only) { // parse the receptor and set up its scoring once for all the ligands
+		vina_profile setup;
+		doing(settings.verbosity, "Reading receptor", log);
+		model receptor = parse_receptor(rigid_opt.get(), flex_opt, &setup);
+		done(settings.verbosity, log);
+
+		doing(settings.verbosity, "Setting up the scoring function", log);
+		receptor_session rs(receptor, gd, weights, setup, settings);
+		done(settings.verbosity, log);
+
+		VINA_FOR_IN(i, ligands)
+			dock_in_session(rs, ligands[i], out_names_used[i], settings, log, results ? &(*results)[i] : NULL);
 	}
+	else {
+		VINA_FOR_IN(i, ligands) {
+			vina_result* result = results ? &(*results)[i] : NULL;
+			doing(settings.verbosity, "Reading input", log);
+			model m = parse_bundle(rigid_opt, flex_opt, std::vector<pdbqt_input>(1, ligands[i]), profile_of(result));
+			boost::optional<model> ref;
+			done(settings.verbosity, log);
 
-	main_procedure(m, ref,
-				out_name,
-				score_only, local_only, randomize_only, false, // no_cache == false
-				gd, exhaustiveness,
-				weights,
-				cpu, seed, verbosity, max_modes_sz, energy_range, log);
+			main_procedure(m, ref,
+						out_names_used[i],
+						settings.score_only, settings.local_only, settings.randomize_only, false, // no_cache == false
+						gd, settings, settings.exhaustiveness,
+						weights, settings.compact_tables,
+						settings.cpu, settings.seed, settings.verbosity, static_cast<sz>(settings.num_modes), settings.energy_range, log,
+						result);
+		}
+	}
+	return 0;
 }
-int vina_cpp(const boost::optional<std::string>& rigid_name_opt,
-	const boost::optional<std::string>& flex_name_opt,
-	std::string ligand_name,
-	const boost::optional<std::string>& out_name_opt)
-{
-	try{
-		main_with_args(rigid_name_opt, flex_name_opt, ligand_name, out_name_opt);
+
+void rethrow_as_vina_error() { // call from a catch block only
+	try {
+		throw;
+	}
+	catch(vina_error&) {
+		throw;
 	}
 	catch(file_error& e) {
 		throw vina_error("\n\nError: could not open \"" + e.name.native_file_string() + "\" for " + (e.in ? "reading" : "writing") + ".\n");
-
 	}
 	catch(boost::filesystem::filesystem_error& e) {
 		throw vina_error(std::string("\n\nFile system error: ") + e.what() + '\n');
@@ -480,7 +1050,318 @@ int vina_cpp(const boost::optional<std::string>& rigid_name_opt,
 	catch(std::bad_alloc&) {
 		throw vina_error(std::string("\n\nError: insufficient memory!\n"));
 	}
+
+	// Errors that shouldn't happen, but must not leave the R session either:
+
+	catch(std::exception& e) {
+		throw vina_error(std::string("\n\nAn error occurred: ") + e.what() + ".\n");
+	}
+	catch(internal_error& e) {
+		throw vina_error("\n\nAn internal error occurred in " + e.file + "(" + to_string(e.line) + ").\n");
+	}
+	catch(...) {
+		throw vina_error(std::string("\n\nAn unknown error occurred.\n"));
+	}
+}
+
+int vina_cpp(const boost::optional<std::string>& rigid_name_opt,
+	const boost::optional<std::string>& flex_name_opt,
+	std::string ligand_name,
+	const boost::optional<std::string>& out_name_opt,
+	const search_settings& settings,
+	vina_result& result)
+{
+	try{
+		std::vector<std::string> out_names(1);
+		if(out_name_opt)
+			out_names[0] = out_name_opt.get();
+		else {
+			out_names[0] = default_output(ligand_name);
+			tee log;
+			log << "Output will be " << out_names[0] << '\n';
+		}
+		boost::optional<pdbqt_input> rigid_opt, flex_opt;
+		if(rigid_name_opt)
+			rigid_opt = pdbqt_input(rigid_name_opt.get());
+		if(flex_name_opt)
+			flex_opt = pdbqt_input(flex_name_opt.get());
+		std::vector<vina_result> results;
+		main_with_args(rigid_opt, flex_opt, std::vector<pdbqt_input>(1, pdbqt_input(ligand_name)), out_names, settings, &results);
+		result = results.front();
+		return 0;
+	}
+	catch(...) {
+		rethrow_as_vina_error();
+	}
+	return 1;
+}
+
+int vina_screen_cpp(const boost::optional<pdbqt_input>& rigid_opt,
+	const boost::optional<pdbqt_input>& flex_opt,
+	const std::vector<pdbqt_input>& ligands,
+	const std::vector<std::string>& out_names,
+	const search_settings& settings,
+	std::vector<vina_result>& results)
+{
+	try{
+		return main_with_args(rigid_opt, flex_opt, ligands, out_names, settings, &results);
+	}
+	catch(...) {
+		rethrow_as_vina_error();
+	}
+	return 1;
 }
+
+receptor_session* vina_receptor_cpp(const pdbqt_input& rigid,
+	const boost::optional<pdbqt_input>& flex_opt,
+	const search_settings& settings)
+{
+	try{
+		check_settings(settings);
+		tee log;
+
+		vina_profile setup;
+		doing(settings.verbosity, "Reading receptor", log);
+		model receptor = parse_receptor(rigid, flex_opt, &setup);
+		done(settings.verbosity, log);
+
+		doing(settings.verbosity, "Setting up the scoring function", log);
+		grid_dims gd = box_grid_dims(settings);
+		receptor_session* rs = new receptor_session(receptor, gd, default_weights(), setup, settings);
+		done(settings.verbosity, log);
+		return rs;
+	}
+	catch(...) {
+		rethrow_as_vina_error();
+	}
+	return NULL;
+}
+
+void vina_receptor_free(receptor_session* rs) {
+	bool unused;
+	{
+		boost::mutex::scoped_lock lk(rs->jobs_mutex);
+		rs->released = true;
+		unused = (rs->jobs_pending == 0);
+	}
+	if(unused)
+		delete rs; // otherwise the last job using it does
+}
+
+int vina_dock_cpp(receptor_session& rs,
+	const pdbqt_input& ligand,
+	const boost::optional<std::string>& out_name_opt,
+	const search_settings& settings_given,
+	vina_result& result)
+{
+	try{
+		check_settings(settings_given);
+		search_settings settings = settings_given;
+		tee log;
+		settings.cpu = usable_cpus(settings, log);
+
+		std::string out_name; // no output file unless asked for
+		if(out_name_opt)
+			out_name = out_name_opt.get();
+		dock_in_session(rs, ligand, out_name, settings, log, &result);
+		return 0;
+	}
+	catch(...) {
+		rethrow_as_vina_error();
+	}
+	return 1;
+}
+
+struct docking_job {
+	receptor_session* rs;
+	pdbqt_input ligand;
+	std::string out_name;
+	search_settings settings;
+	vina_job_status status;
+	vina_result result;
+	std::string error_message; // if failed
+	boost::shared_ptr<progress_monitor> monitor; // shared with the copy being run
+	docking_job(receptor_session* rs_, const pdbqt_input& ligand_, const std::string& out_name_, const search_settings& settings_)
+		: rs(rs_), ligand(ligand_), out_name(out_name_), settings(settings_), status(vina_job_queued), monitor(new progress_monitor) {}
+	void run() { // never throws
+		try {
+			try {
+				std::ostringstream own_log; // the pool threads never write to std::cout
+				tee log(own_log);
+				settings.cpu = usable_cpus(settings, log);
+				dock_in_session(*rs, ligand, out_name, settings, log, &result, monitor.get());
+				status = vina_job_done;
+				return;
+			}
+			catch(...) {
+				rethrow_as_vina_error();
+			}
+		}
+		catch(vina_error& e) {
+			error_message = e.error_message;
+		}
+		catch(...) {
+			error_message = "\n\nAn internal error occurred in the docking job.\n";
+		}
+		status = vina_job_failed;
+	}
+};
+
+struct job_pool : private boost::noncopyable { // persistent worker threads taking the submitted jobs in turn
+	job_pool(sz num_threads) : next_id(1) {
+		VINA_FOR(i, num_threads)
+			threads.create_thread(worker(this));
+	}
+	int submit(const boost::shared_ptr<docking_job>& j) {
+		{
+			boost::mutex::scoped_lock lk(j->rs->jobs_mutex);
+			++j->rs->jobs_pending;
+		}
+		boost::mutex::scoped_lock self_lk(self);
+		int id = next_id++;
+		jobs[id] = j;
+		queue.push_back(id);
+		work.notify_one();
+		return id;
+	}
+	vina_job_status poll(int id) {
+		boost::mutex::scoped_lock self_lk(self);
+		return find(id)->status;
+	}
+	boost::shared_ptr<progress_monitor> monitor(int id) {
+		boost::mutex::scoped_lock self_lk(self);
+		return find(id)->monitor;
+	}
+	boost::shared_ptr<docking_job> collect(int id) { // waits for the job, and forgets it
+		boost::mutex::scoped_lock self_lk(self);
+		boost::shared_ptr<docking_job> j = find(id);
+		while(j->status == vina_job_queued || j->status == vina_job_running)
+			finished.wait(self_lk);
+		jobs.erase(id);
+		return j;
+	}
+private:
+	void loop() {
+		while(true) {
+			boost::shared_ptr<docking_job> j;
+			{
+				boost::mutex::scoped_lock self_lk(self);
+				while(queue.empty())
+					work.wait(self_lk);
+				j = jobs[queue.front()];
+				queue.pop_front();
+				j->status = vina_job_running;
+			}
+			docking_job tmp = *j; // works on its own copy, so that polling does not race with it
+			tmp.run();
+
+			receptor_session* rs = j->rs;
+			{
+				boost::mutex::scoped_lock self_lk(self);
+				j->status = tmp.status;
+				j->result = tmp.result;
+				j->error_message = tmp.error_message;
+				finished.notify_all();
+			}
+			bool unused;
+			{
+				boost::mutex::scoped_lock lk(rs->jobs_mutex);
+				--rs->jobs_pending;
+				unused = (rs->released && rs->jobs_pending == 0);
+			}
+			if(unused)
+				delete rs;
+		}
+	}
+	const boost::shared_ptr<docking_job>& find(int id) {
+		std::map<int, boost::shared_ptr<docking_job> >::const_iterator it = jobs.find(id);
+		if(it == jobs.end())
+			throw usage_error("No such job: " + to_string(id));
+		return it->second;
+	}
+	struct worker {
+		job_pool* pool;
+		worker(job_pool* pool_) : pool(pool_) {}
+		void operator()() const { pool->loop(); }
+	};
+	boost::mutex self; // any modification or reading of the jobs should lock this first
+	boost::condition work;
+	boost::condition finished;
+	std::map<int, boost::shared_ptr<docking_job> > jobs;
+	std::deque<int> queue;
+	int next_id;
+	boost::thread_group threads;
+};
+
+job_pool& docking_jobs() {
+	static job_pool* pool = NULL; // never destroyed, since its workers can be docking at exit
+	if(!pool) {
+		unsigned num_cpus = boost::thread::hardware_concurrency();
+		pool = new job_pool((num_cpus > 0) ? num_cpus : 1);
+	}
+	return *pool;
+}
+
+int vina_submit_cpp(receptor_session& rs,
+	const pdbqt_input& ligand,
+	const boost::optional<std::string>& out_name_opt,
+	const search_settings& settings_given)
+{
+	try{
+		check_settings(settings_given);
+		search_settings settings = settings_given;
+		settings.verbosity = 0; // no progress bars or mode tables from concurrent jobs
+
+		std::string out_name; // no output file unless asked for
+		if(out_name_opt)
+			out_name = out_name_opt.get();
+		boost::shared_ptr<docking_job> j(new docking_job(&rs, ligand, out_name, settings));
+		return docking_jobs().submit(j);
+	}
+	catch(...) {
+		rethrow_as_vina_error();
+	}
+	return 0;
+}
+
+vina_job_status vina_poll_cpp(int job) {
+	try{
+		return docking_jobs().poll(job);
+	}
+	catch(...) {
+		rethrow_as_vina_error();
+	}
+	return vina_job_failed;
+}
+
+int vina_progress_cpp(int job, unsigned long& steps_done, unsigned long& steps_total) {
+	try{
+		docking_jobs().monitor(job)->get(steps_done, steps_total);
+		return 0;
+	}
+	catch(...) {
+		rethrow_as_vina_error();
+	}
+	return 1;
+}
+
+int vina_collect_cpp(int job, vina_result& result) {
+	try{
+		boost::shared_ptr<docking_job> j = docking_jobs().collect(job);
+		if(j->status == vina_job_failed)
+			throw vina_error(j->error_message);
+		result = j->result;
+		return 0;
+	}
+	catch(vina_error&) {
+		throw;
+	}
+	catch(...) {
+		rethrow_as_vina_error();
+	}
+	return 1;
+}
+
 // int main_backup(int argc, char const *argv[]) {
 // 		const std::string version_string = "AutoDock Vina 1.1.2 (May 11, 2011)";
 // 		const std::string error_message = "\n\n\
@@ -1,11 +1,114 @@
 #ifndef VINA_MAIN_H
 #define VINA_MAIN_H
 #include <string>
+#include <vector>
 #include <boost/optional.hpp>
 
+struct vina_mode { // one docked pose
+	double energy; // kcal/mol
+	double rmsd_lb; // distance from the best mode
+	double rmsd_ub;
+	std::vector<double> coords; // x, y, z of every movable heavy atom in turn
+	int pocket; // index in search_settings::pockets of the one it was found in, 0 if there are none
+};
+
+struct vina_phase { // where the time went
+	std::string name;
+	double wall; // seconds
+	double cpu; // seconds, of all the threads of the process
+	unsigned long calls;
+};
+
+struct vina_profile {
+	std::vector<vina_phase> phases; // in the order they first ran; a receptor set up once shows up in its first docking
+	unsigned long evals; // energy and gradient evaluations of the local optimizations
+	unsigned long bfgs_steps;
+	unsigned long line_search_trials;
+	vina_profile() : evals(0), bfgs_steps(0), line_search_trials(0) {}
+};
+
+struct vina_result {
+	std::vector<vina_mode> modes; // best mode first
+	vina_profile profile;
+};
+
+struct vina_pocket { // a search space within the grid maps, in Angstrom
+	double center_x, center_y, center_z;
+	double size_x, size_y, size_z;
+};
+
+struct search_settings { // how a docking run is done; the defaults are those of the vina command line
+	double center_x, center_y, center_z; // search space, in Angstrom
+	double size_x, size_y, size_z;
+	int cpu; // thread budget of the call, 0 to use all the detected cores
+	int seed; // random unless set
+	int exhaustiveness, verbosity, num_modes;
+	double energy_range; // kcal/mol
+	bool score_only, local_only, randomize_only;
+	std::string cache_dir; // if not empty, the grid maps of a receptor are kept there, and reused by later runs with the same receptor and box
+	std::string grid_storage; // of the grid maps in memory: "double", or "float" and "int16" to save memory at a small loss of accuracy (see grid.h)
+	std::string grid_layout; // of the grid points in memory: "linear", "blocked" to keep nearby points in the same cache lines, or "sparse" to also keep a single value where they are all the same
+	bool grid_interleave; // keeps the values of all the atom types side by side at every grid point
+	double grid_spacing; // between the grid points, in Angstrom
+	std::string grid_interpolation; // between the grid points: "trilinear", or "tricubic" to keep the accuracy at a coarser grid_spacing, such as 0.5 - 0.75
+	bool grid_lazy; // computes each brick of the grid maps when the search first needs it, rather than all of them before; they are then not kept in cache_dir
+	bool compact_tables; // scores the searches with float tables of only the atom type pairs of each docking (see precalculate.h)
+	bool split_box; // searches a box over 27000 Angstrom^3 as overlapping sub-boxes of at most about that, all at once, merging their modes
+	std::vector<vina_pocket> pockets; // if not empty, searched all at once instead of the box above, with grid maps covering them all; the modes are kept per pocket
+	search_settings();
+};
+
+struct pdbqt_input { // a PDBQT file, or PDBQT text already in memory
+	std::string name; // the file to read, or only a label for error messages if the text is given
+	boost::optional<std::string> text;
+	pdbqt_input(const std::string& name_) : name(name_) {}
+	pdbqt_input(const std::string& name_, const std::string& text_) : name(name_), text(text_) {}
+};
+
 int vina_cpp(const boost::optional<std::string>& rigid_name_opt,
 	const boost::optional<std::string>& flex_name_opt,
 	std::string ligand_name,
-	const boost::optional<std::string>& out_name);
+	const boost::optional<std::string>& out_name,
+	const search_settings& settings,
+	vina_result& result);
+
+// docks every ligand against the same receptor, which is parsed and analyzed only once
+int vina_screen_cpp(const boost::optional<pdbqt_input>& rigid_opt,
+	const boost::optional<pdbqt_input>& flex_opt,
+	const std::vector<pdbqt_input>& ligands,
+	const std::vector<std::string>& out_names, // empty (no output files), or one per ligand
+	const search_settings& settings,
+	std::vector<vina_result>& results); // one per ligand
+
+struct receptor_session; // parsed receptor with its scoring tables and grids, kept alive between dockings
+
+receptor_session* vina_receptor_cpp(const pdbqt_input& rigid,
+	const boost::optional<pdbqt_input>& flex_opt,
+	const search_settings& settings); // the search space there is the one the grids cover
+
+void vina_receptor_free(receptor_session* rs);
+
+int vina_dock_cpp(receptor_session& rs,
+	const pdbqt_input& ligand,
+	const boost::optional<std::string>& out_name_opt, // no output file if not given
+	const search_settings& settings, // the search space is that of the receptor
+	vina_result& result);
+
+enum vina_job_status { vina_job_queued, vina_job_running, vina_job_done, vina_job_failed };
+
+// queues the docking for the background threads, and returns its job id; the caller can
+// free rs right away, it is kept alive until its jobs are done
+int vina_submit_cpp(receptor_session& rs,
+	const pdbqt_input& ligand,
+	const boost::optional<std::string>& out_name_opt,
+	const search_settings& settings); // the search space is that of the receptor
+
+vina_job_status vina_poll_cpp(int job);
+
+// Monte Carlo steps done so far, out of the total; both are 0 until the search starts
+int vina_progress_cpp(int job, unsigned long& steps_done, unsigned long& steps_total);
+
+// waits for the job, then forgets it; a failed job throws its vina_error
+int vina_collect_cpp(int job, vina_result& result);
 
 #endif